@@ -60,7 +60,19 @@
 /* 
  * Maximum heap size in bytes 
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
+
+/*
+ * Set USE_MMAP_HEAP to "1" to model the heap with address space reserved 
+ * by mmap instead of a malloc'd buffer. Pages are committed as the heap 
+ * grows, and returned to the kernel when the heap shrinks or when the 
+ * malloc package releases a free region with mem_release().
+ */
+#ifndef USE_MMAP_HEAP
+#define USE_MMAP_HEAP 0
+#endif
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -0,0 +1,120 @@
+/*
+ * fperf.c - Count the hardware events caused by a function f
+ *
+ * Uses perf_event_open(2) on Linux to count the instructions, cache 
+ * misses, branch misses and data TLB misses of f, plus page faults, 
+ * which the kernel counts even where the CPU has no counters to share 
+ * (e.g. in most virtual machines). Each event has a counter of its 
+ * own, so a missing event doesn't keep the others from being counted. 
+ * If the kernel multiplexes the counters, counts are scaled up to the 
+ * whole run.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "fperf.h"
+
+char *fperf_names[FPERF_EVENTS] = {
+    "instr", "cache-miss", "branch-miss", "dTLB-miss", "page-fault"
+};
+
+/* Type and config of each event for perf_event_open */
+static struct {
+    unsigned type;
+    unsigned long long config;
+} events[FPERF_EVENTS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | 
+     (PERF_COUNT_HW_CACHE_OP_READ << 8) | 
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+static int fds[FPERF_EVENTS];   /* counter of each event, or -1 */
+static int opened = 0;          /* have the counters been opened? */
+
+/*
+ * init_fperf - Open a counter for each event. Returns the number of 
+ *     events the machine can count.
+ */
+int init_fperf(void)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    for (i = 0; i < FPERF_EVENTS; i++) {
+	if (opened && fds[i] >= 0)
+	    close(fds[i]);
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | 
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    n++;
+    }
+    opened = 1;
+    return n;
+}
+
+/*
+ * read_counter - Return the count of a counter, scaled up if the 
+ *     kernel ran it for part of the time only
+ */
+static double read_counter(int fd)
+{
+    unsigned long long buf[3]; /* value, time enabled, time running */
+
+    if (read(fd, buf, sizeof(buf)) != sizeof(buf))
+	return -1;
+    if (buf[2] == 0)
+	return 0;
+    return (double)buf[0] * buf[1] / buf[2];
+}
+
+/*
+ * fperf - Count the events of f(argp), keeping the least count of 
+ *     each event over n runs
+ */
+void fperf(fperf_test_funct f, void *argp, int n, double counts[])
+{
+    double c;
+    int i, r;
+
+    if (!opened)
+	init_fperf();
+    for (i = 0; i < FPERF_EVENTS; i++)
+	counts[i] = -1;
+
+    for (r = 0; r < n; r++) {
+	for (i = 0; i < FPERF_EVENTS; i++) {
+	    if (fds[i] >= 0) {
+		ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	    }
+	}
+	f(argp);
+	for (i = 0; i < FPERF_EVENTS; i++)
+	    if (fds[i] >= 0)
+		ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+	for (i = 0; i < FPERF_EVENTS; i++) {
+	    if (fds[i] < 0)
+		continue;
+	    c = read_counter(fds[i]);
+	    if (c >= 0 && (counts[i] < 0 || c < counts[i]))
+		counts[i] = c;
+	}
+    }
+}
@@ -0,0 +1,26 @@
+/*
+ * fperf.h - prototypes for the routines in fperf.c that count the
+ *     hardware events (instructions, cache misses, ...) caused by a 
+ *     test function f
+ */
+
+#define FPERF_EVENTS 5   /* number of events counted */
+
+/* The test function takes a generic pointer as input */
+typedef void (*fperf_test_funct)(void *);
+
+/* Short names of the events, in the order of the counts */
+extern char *fperf_names[FPERF_EVENTS];
+
+/* 
+ * init_fperf - Open a counter for each event. Returns the number of 
+ *     events the machine can count, 0 if perf_event_open isn't allowed
+ */
+int init_fperf(void);
+
+/* 
+ * fperf - Count the events of f(argp) in user mode, keeping the least 
+ *     count of each event over n runs. Counts of events the machine 
+ *     can't count are set to -1.
+ */
+void fperf(fperf_test_funct f, void *argp, int n, double counts[]);
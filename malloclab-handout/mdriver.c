@@ -12,14 +12,22 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
 #include <float.h>
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fperf.h"
 #include "config.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -29,28 +37,39 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAXTHREADS    64 /* max number of threads for -T */
+#define MAXJOBS       64 /* max number of worker processes for -j */
+#define MT_RUNS        3 /* keep the fastest of this many threaded replays */
+#define STREAM_CHUNK 65536 /* ops per buffer of a streaming replay */
+#define FPERF_RUNS     3 /* keep the least event counts of this many runs */
+#define FRAG_SAMPLES 200 /* heap shape samples per trace for -F */
+#define LAT_SUB_BITS   3 /* log2 of the latency buckets per power of 2 */
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  (64 * LAT_SUB) /* enough for any 64-bit latency */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
+
+/* Unit of the op latencies of -L: the time stamp counter on x86 */
+#if defined(__i386__) || defined(__x86_64__)
+#define LAT_UNIT "cycles"
+#else
+#define LAT_UNIT "ns"
+#endif
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    unsigned prio;         /* random priority, higher than the children's */
+    struct range_t *left;  /* ranges with lower addresses */
+    struct range_t *right; /* ranges with higher addresses */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file*/
 typedef struct {
     int sugg_heapsize;   /* suggested heap size (unused) */
@@ -60,6 +79,9 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    char *block_types;   /* ... and the type of request that made each one */
+    void *map;           /* mapping of a binary trace file, or NULL */
+    size_t map_len;      /* length of the mapping */
 } trace_t;
 
 /* 
@@ -81,10 +103,97 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double rss;      /* resident heap bytes after the trace (0 for libc or
+			without USE_MMAP_HEAP) */
+    double sbrks;    /* times the heap grew (always 0 for libc) */
+    double merges;   /* growths merged with a free block at the top */
+
+    /* defined only with -P */
+    double events[FPERF_EVENTS]; /* hardware event counts, -1 if unknown */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* Result of checking one trace in a worker process of -j */
+typedef struct {
+    int tracenum;    /* trace checked */
+    int valid;       /* was the trace processed correctly by mm? */
+    int errors;      /* number of errors the worker reported */
+    double util;     /* space utilization for this trace */
+    double rss;      /* resident heap bytes after the trace */
+    double sbrks;    /* times the heap grew */
+    double merges;   /* growths merged with a free block at the top */
+} check_t;
+
+/* Parameters and results of one thread of a multithreaded replay */
+typedef struct {
+    trace_t *trace;             /* trace shared by all threads */
+    int tid;                    /* replays the ids with index % nthreads == tid */
+    int nthreads;               /* number of threads replaying the trace */
+    pthread_barrier_t *barrier; /* start all threads at once */
+    int nops;                   /* number of ops replayed by this thread */
+    double *lat;                /* latency of each op in usecs */
+    double start, end;          /* timestamps of the replay in usecs */
+    int failed;                 /* did some mm call fail? */
+} mt_thread_t;
+
+/* Summarizes a multithreaded replay of one trace */
+typedef struct {
+    int valid;                  /* did every thread run to completion? */
+    double ops;                 /* number of ops in the trace */
+    double secs;                /* wall clock secs of the fastest run */
+    double p50, p99, max;       /* op latencies over all threads (usecs) */
+    unsigned long hits, misses; /* thread cache lookups of the fastest run */
+    int nops[MAXTHREADS];       /* ops replayed by each thread */
+    double thread_p50[MAXTHREADS];
+    double thread_p99[MAXTHREADS];
+    double thread_max[MAXTHREADS];
+} mt_stats_t;
+
+/* Log-bucketed histogram of op latencies. Values below LAT_SUB have a
+   bucket each; every higher power of 2 is split into LAT_SUB buckets,
+   so a bucket is at most 1/LAT_SUB of its values wide */
+typedef struct {
+    unsigned long count[LAT_BUCKETS];
+    unsigned long n;            /* number of ops */
+    unsigned long max;          /* exact max latency */
+} lat_hist_t;
+
+/* Latencies of the mm ops of one trace, by type of op */
+typedef struct {
+    int valid;                  /* was the trace replayed? */
+    lat_hist_t hist[3];         /* indexed by ALLOC, FREE and REALLOC */
+} lat_stats_t;
+
+/* Live block of a streaming replay, kept in an open-addressing table */
+typedef struct {
+    int id;                     /* trace id, or -1 if the slot is empty */
+    int size;                   /* payload size */
+    char *p;                    /* payload returned by malloc/realloc */
+} live_t;
+
+/* Reads a trace in chunks on its own thread, one buffer ahead */
+typedef struct {
+    FILE *file;                 /* trace file, positioned after the header */
+    int binary;                 /* is it a binary trace? */
+    traceop_t *buf[2];          /* buffers filled in turn by the reader */
+    int count[2];               /* ops in each buffer, 0 at end of trace */
+    int full[2];                /* is the buffer ready for the replay? */
+    int stop;                   /* set by the replay to stop the reader */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} stream_t;
+
+/* Summarizes a streaming replay of a trace */
+typedef struct {
+    int valid;                  /* did the replay run to completion? */
+    double ops;                 /* number of ops replayed */
+    double secs;                /* secs spent replaying, waits excluded */
+    double wait;                /* secs spent waiting for the reader */
+    double peak_live;           /* peak total payload bytes */
+    double footprint;           /* peak heap bytes (always 0 for libc) */
+} stream_stats_t;
+
 /********************
  * Global variables
  *******************/
@@ -100,12 +209,16 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* Serializes mm calls of a threaded replay if mm.c isn't thread-safe */
+static pthread_mutex_t mm_lock = PTHREAD_MUTEX_INITIALIZER;
+static int mm_locked = 0;
+
 
 /********************* 
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
@@ -113,8 +226,15 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int map_trace(char *path, trace_t *trace);
+static void parse_trace(char *path, trace_t *trace);
 static void free_trace(trace_t *trace);
 
+/* Routines for issuing the allocate and free requests of every type */
+static char *req_mm_alloc(traceop_t *op);
+static void req_mm_free(traceop_t *op, char *p);
+static char *req_libc_alloc(traceop_t *op);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -122,11 +242,44 @@ static void eval_libc_speed(void *ptr);
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static int eval_mm_limits(void);
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss);
 static void eval_mm_speed(void *ptr);
 
+/* Routines for replaying a trace with several threads */
+static void *mt_replay(void *ptr);
+static int eval_mm_threads(trace_t *trace, int nthreads, mt_stats_t *stats);
+static void print_mt_results(int n, int nthreads, 
+			     mt_stats_t *base, mt_stats_t *stats);
+
+/* Routines for checking traces in parallel worker processes */
+static void eval_mm_check(trace_t *trace, int tracenum, stats_t *stats);
+static void eval_mm_parallel(char *tracedir, char **tracefiles, int n,
+			     int njobs, stats_t *stats);
+
+/* Routines for sampling the heap shape during a replay */
+static void print_frag_header(FILE *fp);
+static void eval_mm_frag(trace_t *trace, int tracenum, FILE *fp);
+
+/* Routines for timing each op of a trace */
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats);
+static void print_lat_results(int n, lat_stats_t *stats);
+
+/* Routines for replaying a trace too big to be kept in memory */
+static void *stream_reader(void *ptr);
+static void eval_stream(char *path, int libc, stream_stats_t *stats);
+static void print_stream_results(char *path, stream_stats_t *mm, 
+				 stream_stats_t *libc);
+
+/* Routines for comparing immediate and deferred coalescing of mm.c */
+static void eval_mm_stats(trace_t *trace, int tracenum, stats_t *stats,
+			  int checked);
+static void print_defer_results(int n, stats_t *base, stats_t *stats);
+
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void print_perf_results(int n, stats_t *stats, char *name);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -142,14 +295,25 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *defer_stats = NULL; /* mm stats with deferred coalescing */
+    lat_stats_t *lat_stats = NULL; /* mm op latencies for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
+    int run_defer = 0;   /* If set, run mm with deferred coalescing (set by -d) */
+    int run_latency = 0; /* If set, time each mm op as well (set by -L) */
+    int run_perf = 0;    /* If set, count hardware events as well (set by -P) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int num_threads = 0; /* If set, also replay with this many threads (-T) */
+    int num_jobs = 1;    /* Number of worker processes checking traces (-j) */
+    char *stream_file = NULL; /* If set, only stream this trace (-S) */
+    FILE *frag_file = NULL;   /* If set, write heap shape samples here (-F) */
+    stream_stats_t stream_mm, stream_libc; /* results of the streaming replay */
+    mt_stats_t *mt_base = NULL;  /* single-thread replay stats per trace */
+    mt_stats_t *mt_stats = NULL; /* multithreaded replay stats per trace */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +322,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgaldLPT:S:j:F:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +348,37 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'd': /* Run mm malloc with deferred coalescing as well */
+            run_defer = 1;
+            break;
+        case 'L': /* Time each mm op of each trace */
+            run_latency = 1;
+            break;
+        case 'P': /* Count hardware events of each trace */
+            run_perf = 1;
+            break;
+        case 'T': /* Replay each trace with several threads */
+            num_threads = atoi(optarg);
+            if (num_threads < 1 || num_threads > MAXTHREADS) {
+                fprintf(stderr, "-T must be between 1 and %d\n", MAXTHREADS);
+                exit(1);
+            }
+            break;
+        case 'j': /* Check traces in several worker processes */
+            num_jobs = atoi(optarg);
+            if (num_jobs < 1 || num_jobs > MAXJOBS) {
+                fprintf(stderr, "-j must be between 1 and %d\n", MAXJOBS);
+                exit(1);
+            }
+            break;
+        case 'F': /* Sample the heap shape of each trace into a CSV file */
+            if ((frag_file = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: can't open the -F file");
+            print_frag_header(frag_file);
+            break;
+        case 'S': /* Stream one big trace instead of loading traces */
+            stream_file = optarg;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -225,6 +420,19 @@ int main(int argc, char **argv)
 	    printf("Member 2 :%s:%s\n", team.name2, team.id2);
     }
 
+    /*
+     * Optionally stream a single trace through mm and libc, and exit
+     */
+    if (stream_file) {
+	mem_init();
+	eval_stream(stream_file, 0, &stream_mm);
+	if (run_libc)
+	    eval_stream(stream_file, 1, &stream_libc);
+	print_stream_results(stream_file, &stream_mm, 
+			     run_libc ? &stream_libc : NULL);
+	exit(errors ? 1 : 0);
+    }
+
     /* 
      * If no -f command line arg, then use the entire set of tracefiles 
      * defined in default_traces[]
@@ -238,6 +446,12 @@ int main(int argc, char **argv)
     /* Initialize the timing package */
     init_fsecs();
 
+    /* Open the hardware event counters */
+    if (run_perf && init_fperf() == 0) {
+	printf("Can't count hardware events: perf_event_open not allowed.\n");
+	run_perf = 0;
+    }
+
     /*
      * Optionally run and evaluate the libc malloc package 
      */
@@ -262,6 +476,9 @@ int main(int argc, char **argv)
 		if (verbose > 1)
 		    printf("and performance.\n");
 		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		if (run_perf)
+		    fperf(eval_libc_speed, &speed_params, FPERF_RUNS, 
+			  libc_stats[i].events);
 	    }
 	    free_trace(trace);
 	}
@@ -271,6 +488,10 @@ int main(int argc, char **argv)
 	    printf("\nResults for libc malloc:\n");
 	    printresults(num_tracefiles, libc_stats);
 	}
+	if (run_perf) {
+	    printf("\n");
+	    print_perf_results(num_tracefiles, libc_stats, "libc");
+	}
     }
 
     /*
@@ -284,25 +505,62 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
     
+    /* Allocate the stats arrays of the threaded replays */
+    if (num_threads) {
+	mt_base = (mt_stats_t *)calloc(num_tracefiles, sizeof(mt_stats_t));
+	mt_stats = (mt_stats_t *)calloc(num_tracefiles, sizeof(mt_stats_t));
+	if (mt_base == NULL || mt_stats == NULL)
+	    unix_error("mt_stats calloc in main failed");
+	mm_locked = !mm_thread_safe();
+    }
+
+    /* Allocate the latency stats array */
+    if (run_latency) {
+	lat_stats = (lat_stats_t *)calloc(num_tracefiles, sizeof(lat_stats_t));
+	if (lat_stats == NULL)
+	    unix_error("lat_stats calloc in main failed");
+    }
+
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
+    /* Requests that no heap can hold must fail cleanly */
+    eval_mm_limits();
+
+    /* The baseline of -d always coalesces immediately */
+    if (run_defer)
+	mm_set_deferred(0);
+
+    /* Check correctness and utilization in worker processes if -j */
+    if (num_jobs > 1)
+	eval_mm_parallel(tracedir, tracefiles, num_tracefiles, num_jobs, 
+			 mm_stats);
+
     /* Evaluate student's mm malloc package using the K-best scheme */
     for (i=0; i < num_tracefiles; i++) {
 	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
+	eval_mm_stats(trace, i, &mm_stats[i], num_jobs > 1);
+	if (mm_stats[i].valid && run_perf) {
 	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
+		printf("Counting hardware events.\n");
 	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
+	    fperf(eval_mm_speed, &speed_params, FPERF_RUNS, mm_stats[i].events);
+	}
+	if (mm_stats[i].valid && frag_file) {
+	    if (verbose > 1)
+		printf("Sampling the heap shape.\n");
+	    eval_mm_frag(trace, i, frag_file);
+	}
+	if (mm_stats[i].valid && run_latency) {
+	    if (verbose > 1)
+		printf("Timing each op.\n");
+	    eval_mm_latency(trace, &lat_stats[i]);
+	}
+	if (mm_stats[i].valid && num_threads) {
 	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+		printf("Replaying with 1 and %d threads.\n", num_threads);
+	    if (eval_mm_threads(trace, 1, &mt_base[i]))
+		eval_mm_threads(trace, num_threads, &mt_stats[i]);
 	}
 	free_trace(trace);
     }
@@ -314,6 +572,58 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    if (frag_file)
+	fclose(frag_file);
+
+    /* Display the hardware event counts */
+    if (run_perf) {
+	print_perf_results(num_tracefiles, mm_stats, "mm");
+	printf("\n");
+    }
+
+    /* Display the op latencies */
+    if (run_latency) {
+	print_lat_results(num_tracefiles, lat_stats);
+	printf("\n");
+    }
+
+    /* Display the threaded replay results */
+    if (num_threads) {
+	print_mt_results(num_tracefiles, num_threads, mt_base, mt_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally run the mm package again with deferred coalescing
+     */
+    if (run_defer) {
+	if (verbose > 1)
+	    printf("Testing mm malloc with deferred coalescing\n");
+
+	defer_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (defer_stats == NULL)
+	    unix_error("defer_stats calloc in main failed");
+
+	mm_set_deferred(1);
+	if (num_jobs > 1)
+	    eval_mm_parallel(tracedir, tracefiles, num_tracefiles, num_jobs, 
+			     defer_stats);
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    eval_mm_stats(trace, i, &defer_stats[i], num_jobs > 1);
+	    free_trace(trace);
+	}
+	mm_set_deferred(0);
+
+	if (verbose) {
+	    printf("Results for mm malloc with deferred coalescing:\n");
+	    printresults(num_tracefiles, defer_stats);
+	    printf("\n");
+	}
+	print_defer_results(num_tracefiles, mm_stats, defer_stats);
+	printf("\n");
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -367,16 +677,104 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
+ *
+ * The tree is a treap: a binary search tree on the low payload 
+ * address that is also a heap on random priorities, so it stays 
+ * balanced with high probability and every operation is O(log n).
+ * Since the payloads in the tree never overlap, a new payload 
+ * overlaps some payload iff it overlaps the one that starts last 
+ * at or below its high address.
  ****************************************************************/
 
+/*
+ * range_prio - Return the next pseudo-random treap priority (xorshift)
+ */
+static unsigned range_prio(void)
+{
+    static unsigned x = 2463534242u;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+/*
+ * range_pred - Return the range with the highest lo at or below addr,
+ *     or NULL if there is none
+ */
+static range_t *range_pred(range_t *p, char *addr)
+{
+    range_t *best = NULL;
+
+    while (p != NULL) {
+	if (p->lo <= addr) {
+	    best = p;
+	    p = p->right;
+	}
+	else
+	    p = p->left;
+    }
+    return best;
+}
+
+/*
+ * range_insert - Insert range r into the tree rooted at p, rotating it 
+ *     up while its priority beats its parent's. Returns the new root.
+ */
+static range_t *range_insert(range_t *p, range_t *r)
+{
+    range_t *q;
+
+    if (p == NULL)
+	return r;
+    if (r->lo < p->lo) {
+	p->left = range_insert(p->left, r);
+	if (p->left->prio > p->prio) {
+	    q = p->left;
+	    p->left = q->right;
+	    q->right = p;
+	    return q;
+	}
+    }
+    else {
+	p->right = range_insert(p->right, r);
+	if (p->right->prio > p->prio) {
+	    q = p->right;
+	    p->right = q->left;
+	    q->left = p;
+	    return q;
+	}
+    }
+    return p;
+}
+
+/*
+ * range_join - Join two trees, all of whose ranges in l lie below those
+ *     in r. Returns the new root.
+ */
+static range_t *range_join(range_t *l, range_t *r)
+{
+    if (l == NULL)
+	return r;
+    if (r == NULL)
+	return l;
+    if (l->prio > r->prio) {
+	l->right = range_join(l->right, r);
+	return l;
+    }
+    r->left = range_join(l, r->left);
+    return r;
+}
+
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
@@ -385,7 +783,7 @@ static int add_range(range_t **ranges, char *lo, int size,
     range_t *p;
     char msg[MAXLINE];
 
-    assert(size > 0);
+    assert(size >= 0); /* captured traces may allocate 0 bytes */
 
     /* Payload addresses must be ALIGNMENT-byte aligned */
     if (!IS_ALIGNED(lo)) {
@@ -395,9 +793,15 @@ static int add_range(range_t **ranges, char *lo, int size,
         return 0;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    /* 
+     * The payload must lie within the extent of the heap, unless the 
+     * mm package put the block in a mapping of its own. The mm package 
+     * looks that up in its list of mappings, so a wild pointer is 
+     * reported here rather than read.
+     */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+	!mm_mapped_range(lo, hi)) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
@@ -405,26 +809,25 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    p = range_pred(*ranges, (size > 0) ? hi : lo);
+    if (p != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->prio = range_prio();
+    p->left = p->right = NULL;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -434,17 +837,12 @@ static int add_range(range_t **ranges, char *lo, int size,
 static void remove_range(range_t **ranges, char *lo)
 {
     range_t *p;
-    range_t **prevpp = ranges;
-    int size;
 
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
+    while ((p = *ranges) != NULL && p->lo != lo)
+	ranges = (lo < p->lo) ? &p->left : &p->right;
+    if (p != NULL) {
+	*ranges = range_join(p->left, p->right);
+	free(p);
     }
 }
 
@@ -453,13 +851,11 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
-
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    if (*ranges == NULL)
+	return;
+    clear_ranges(&(*ranges)->left);
+    clear_ranges(&(*ranges)->right);
+    free(*ranges);
     *ranges = NULL;
 }
 
@@ -469,17 +865,13 @@ static void clear_ranges(range_t **ranges)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A binary
+ *     trace is mapped as it is; a text trace is parsed into an array.
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -488,9 +880,120 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* Read the header and the requests */
     strcpy(path, tracedir);
     strcat(path, filename);
+    if (!map_trace(path, trace))
+	parse_trace(path, trace);
+
+    /* We'll keep an array of pointers to the allocated blocks here... */
+    if ((trace->blocks = 
+	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
+	unix_error("malloc 3 failed in read_trace");
+
+    /* ... along with the corresponding byte sizes of each block */
+    if ((trace->block_sizes = 
+	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
+	unix_error("malloc 4 failed in read_trace");
+
+    /* ... and the request types, since memalign'd blocks can't be 
+       freed with sized frees */
+    if ((trace->block_types = 
+	 (char *)malloc(trace->num_ids * sizeof(char))) == NULL)
+	unix_error("malloc 5 failed in read_trace");
+    
+    return trace;
+}
+
+/*
+ * map_trace - map a binary trace file written by rep2bin. Returns 0
+ *     if the file is not a binary trace. The records are not parsed,
+ *     but one scan checks that every request has a known type and an
+ *     id the arrays of read_trace hold, and that every realloc or free
+ *     names an allocated block.
+ */
+static int map_trace(char *path, trace_t *trace)
+{
+    int fd, i;
+    struct stat st;
+    trace_hdr_t *hdr;
+    traceop_t *op;
+    char *live;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+	sprintf(msg, "Could not open %s in read_trace", path);
+	unix_error(msg);
+    }
+    if (fstat(fd, &st) < 0)
+	unix_error("fstat failed in map_trace");
+    if (st.st_size < (off_t)sizeof(trace_hdr_t)) {
+	close(fd);
+	return 0;
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (hdr == MAP_FAILED)
+	unix_error("mmap failed in map_trace");
+    if (hdr->magic != TRACE_MAGIC) {
+	munmap(hdr, st.st_size);
+	return 0;
+    }
+
+    /* The requests follow the header */
+    if (hdr->version != TRACE_VERSION || hdr->num_ids < 0 || 
+	hdr->num_ops < 0 || st.st_size != 
+	(off_t)(sizeof(trace_hdr_t) + hdr->num_ops * sizeof(traceop_t))) {
+	sprintf(msg, "Binary tracefile %s is broken or of other version", path);
+	app_error(msg);
+    }
+
+    /* A truncated, hand-edited or foreign-endian file fails here */
+    if ((live = (char *)calloc(hdr->num_ids + 1, 1)) == NULL)
+	unix_error("calloc failed in map_trace");
+    for (i = 0, op = (traceop_t *)(hdr + 1);  i < hdr->num_ops;  i++, op++) {
+	if (op->index < 0 || op->index >= hdr->num_ids || op->size < 0)
+	    break;
+	if (op->type == ALLOC || op->type == CALLOC)
+	    live[op->index] = 1;
+	else if (op->type == MEMALIGN && op->align > 0 && 
+		 (op->align & (op->align - 1)) == 0)
+	    live[op->index] = 1;
+	else if (op->type == REALLOC && live[op->index])
+	    ;
+	else if ((op->type == FREE || op->type == FREE_SIZED) && 
+		 live[op->index])
+	    live[op->index] = 0;
+	else
+	    break;
+    }
+    free(live);
+    if (i < hdr->num_ops) {
+	sprintf(msg, "Broken binary trace %s: bad request %d", path, i);
+	app_error(msg);
+    }
+
+    trace->sugg_heapsize = hdr->sugg_heapsize;
+    trace->num_ids = hdr->num_ids;
+    trace->num_ops = hdr->num_ops;
+    trace->weight = hdr->weight;
+    trace->ops = (traceop_t *)(hdr + 1);
+    trace->map = hdr;
+    trace->map_len = st.st_size;
+    return 1;
+}
+
+/*
+ * parse_trace - parse a text trace file into an array of requests
+ */
+static void parse_trace(char *path, trace_t *trace)
+{
+    FILE *tracefile;
+    char type[MAXLINE];
+    unsigned index, size, align;
+    unsigned max_index = 0;
+    unsigned op_index;
+
+    /* Read the trace file header */
     if ((tracefile = fopen(path, "r")) == NULL) {
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
@@ -499,22 +1002,14 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fscanf(tracefile, "%d", &(trace->num_ids));     
     fscanf(tracefile, "%d", &(trace->num_ops));     
     fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    trace->map = NULL;
+    trace->map_len = 0;
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
 	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 	unix_error("malloc 2 failed in read_trace");
 
-    /* We'll keep an array of pointers to the allocated blocks here... */
-    if ((trace->blocks = 
-	 (char **)malloc(trace->num_ids * sizeof(char *))) == NULL)
-	unix_error("malloc 3 failed in read_trace");
-
-    /* ... along with the corresponding byte sizes of each block */
-    if ((trace->block_sizes = 
-	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
-	unix_error("malloc 4 failed in read_trace");
-    
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
@@ -539,6 +1034,31 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
+	case 'c':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = CALLOC;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 'm':
+	    fscanf(tracefile, "%u %u %u", &index, &align, &size);
+	    if (align == 0 || (align & (align - 1)) != 0) {
+		printf("Bogus alignment (%u) in tracefile %s\n", align, path);
+		exit(1);
+	    }
+	    trace->ops[op_index].type = MEMALIGN;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    trace->ops[op_index].align = align;
+	    max_index = (index > max_index) ? index : max_index;
+	    break;
+	case 's':
+	    fscanf(tracefile, "%u %u", &index, &size);
+	    trace->ops[op_index].type = FREE_SIZED;
+	    trace->ops[op_index].index = index;
+	    trace->ops[op_index].size = size;
+	    break;
 	default:
 	    printf("Bogus type character (%c) in tracefile %s\n", 
 		   type[0], path);
@@ -550,19 +1070,21 @@ static trace_t *read_trace(char *tracedir, char *filename)
     fclose(tracefile);
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
-    
-    return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
+ * free_trace - Free the trace record and the arrays it points
  *              to, all of which were allocated in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
+    if (trace->map)           /* unmap or free the three arrays... */
+	munmap(trace->map, trace->map_len);
+    else
+	free(trace->ops);
     free(trace->blocks);      
     free(trace->block_sizes);
+    free(trace->block_types);
     free(trace);              /* and the trace record itself... */
 }
 
@@ -571,6 +1093,54 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * req_mm_alloc - Call mm_malloc, mm_calloc or mm_memalign for an 
+ *     ALLOC, CALLOC or MEMALIGN request
+ */
+static char *req_mm_alloc(traceop_t *op)
+{
+    switch (op->type) {
+    case CALLOC:
+	return mm_calloc(1, op->size);
+    case MEMALIGN:
+	return mm_memalign(op->align, op->size);
+    default:
+	return mm_malloc(op->size);
+    }
+}
+
+/*
+ * req_mm_free - Call mm_free or mm_free_sized on block p for a FREE 
+ *     or FREE_SIZED request
+ */
+static void req_mm_free(traceop_t *op, char *p)
+{
+    if (op->type == FREE_SIZED)
+	mm_free_sized(p, op->size);
+    else
+	mm_free(p);
+}
+
+/*
+ * req_libc_alloc - Call malloc, calloc or posix_memalign for an ALLOC,
+ *     CALLOC or MEMALIGN request. Sized frees are plain frees in libc.
+ */
+static char *req_libc_alloc(traceop_t *op)
+{
+    void *p;
+
+    switch (op->type) {
+    case CALLOC:
+	return calloc(1, op->size);
+    case MEMALIGN:
+	if (op->align <= sizeof(void *))
+	    return malloc(op->size);
+	return posix_memalign(&p, op->align, op->size) == 0 ? p : NULL;
+    default:
+	return malloc(op->size);
+    }
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -584,7 +1154,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
@@ -602,20 +1172,39 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
+	    if ((p = req_mm_alloc(&trace->ops[i])) == NULL) {
 		malloc_error(tracenum, i, "mm_malloc failed.");
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
 		return 0;
+
+	    /* A calloc'd block must be zeroed, a memalign'd one aligned */
+	    if (trace->ops[i].type == CALLOC) {
+		for (j = 0; j < size; j++) {
+		    if (p[j] != 0) {
+			malloc_error(tracenum, i, "mm_calloc did not zero "
+				     "the block");
+			return 0;
+		    }
+		}
+	    }
+	    if (trace->ops[i].type == MEMALIGN && 
+		((unsigned long)p & (trace->ops[i].align - 1)) != 0) {
+		malloc_error(tracenum, i, "mm_memalign returned a misaligned "
+			     "block");
+		return 0;
+	    }
 	    
 	    /* ADDED: cgw
 	     * fill range with low byte of index.  This will be used later
@@ -627,6 +1216,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remember region */
 	    trace->blocks[index] = p;
 	    trace->block_sizes[index] = size;
+	    trace->block_types[index] = trace->ops[i].type;
 	    break;
 
         case REALLOC: /* mm_realloc */
@@ -638,10 +1228,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -653,7 +1243,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -664,14 +1254,31 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    /* Remember region */
 	    trace->blocks[index] = newp;
 	    trace->block_sizes[index] = size;
+	    trace->block_types[index] = REALLOC;
 	    break;
 
         case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
 	    
+	    /* A sized free must give the size the block was last given */
+	    if (trace->ops[i].type == FREE_SIZED && 
+		size != trace->block_sizes[index]) {
+		malloc_error(tracenum, i, "sized free of a block of other size");
+		return 0;
+	    }
+
+	    /* mm_free_sized takes the size of a memalign'd block for the
+	       size of its segment, so such blocks need mm_free */
+	    if (trace->ops[i].type == FREE_SIZED && 
+		trace->block_types[index] == MEMALIGN) {
+		malloc_error(tracenum, i, "sized free of a memalign'd block");
+		return 0;
+	    }
+
 	    /* Remove region from list and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    req_mm_free(&trace->ops[i], p);
 	    break;
 
 	default:
@@ -684,24 +1291,75 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     return 1;
 }
 
+/*
+ * eval_mm_limits - Check that requests whose sizes overflow fail
+ *     cleanly: mm_memalign with an alignment near the top of size_t, 
+ *     and mm_calloc whose array size doesn't fit in size_t, must
+ *     return NULL. Traces can't hold such requests.
+ */
+static int eval_mm_limits(void)
+{
+    int i, shift, ok;
+    size_t align;
+    static size_t callocs[][2] = {
+	{SIZE_MAX / 2 + 1, 2},
+	{2, SIZE_MAX / 2 + 1},
+	{SIZE_MAX / 16 + 1, 16},
+	{SIZE_MAX, SIZE_MAX},
+    };
+
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	errors++;
+	printf("ERROR [limits]: mm_init failed.\n");
+	return 0;
+    }
+
+    /* A 32-bit size_t has no power of 2 beyond what the size field
+       of a segment can describe, so only 64-bit ones are tried */
+    ok = 1;
+    for (shift = 33; shift < sizeof(size_t) * 8; shift++) {
+	align = (size_t)1 << shift;
+	if (mm_memalign(align, 16) != NULL) {
+	    errors++;
+	    printf("ERROR [limits]: mm_memalign(%#zx, 16) did not fail\n", 
+		   align);
+	    ok = 0;
+	}
+    }
+    for (i = 0; i < sizeof(callocs) / sizeof(callocs[0]); i++) {
+	if (mm_calloc(callocs[i][0], callocs[i][1]) != NULL) {
+	    errors++;
+	    printf("ERROR [limits]: mm_calloc(%#zx, %#zx) did not fail\n", 
+		   callocs[i][0], callocs[i][1]);
+	    ok = 0;
+	}
+    }
+    return ok;
+}
+
 /* 
  * eval_mm_util - Evaluate the space utilization of the student's package
  *   The idea is to remember the high water mark "hwm" of the heap for 
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the 
- *   size of the heap in bytes after running the student's malloc 
- *   package on the trace. Note that our implementation of mem_sbrk() 
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap. 
+ *   high water mark of the heap size in bytes while running the 
+ *   student's malloc package on the trace, counting the bytes the 
+ *   package maps outside the heap for huge blocks. Since mem_sbrk() 
+ *   may decrement the brk pointer, the final brk isn't used. The number of
+ *   heap bytes resident in memory after the trace is stored in rss, or 0
+ *   if memlib can't tell them apart from pages of earlier traces.
  *   
  */
-static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
+static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges,
+			   double *rss)
 {   
     int i;
     int index;
     int size, newsize, oldsize;
     int max_total_size = 0;
     int total_size = 0;
+    size_t footprint, max_footprint = 0;
     char *p;
     char *newp, *oldp;
 
@@ -714,10 +1372,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
+	    if ((p = req_mm_alloc(&trace->ops[i])) == NULL) 
 		app_error("mm_malloc failed in eval_mm_util");
 	    
 	    /* Remember region and size */
@@ -756,11 +1416,12 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    break;
 
         case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
 	    index = trace->ops[i].index;
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    req_mm_free(&trace->ops[i], p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -772,9 +1433,17 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    app_error("Nonexistent request type in eval_mm_util");
 
         }
+
+	/* Track the heap plus the blocks mapped outside of it */
+	footprint = mem_heapsize() + mm_mapped_bytes();
+	max_footprint = (footprint > max_footprint) ? footprint : max_footprint;
     }
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    if (max_footprint < mem_heapsize_max())
+	max_footprint = mem_heapsize_max();
+
+    *rss = (double)mem_resident();
+    return ((double)max_total_size / (double)max_footprint);
 }
 
 
@@ -784,7 +1453,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index, size, newsize;
+    int i, index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -798,9 +1467,10 @@ static void eval_mm_speed(void *ptr)
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
             index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
+            if ((p = req_mm_alloc(&trace->ops[i])) == NULL)
 		app_error("mm_malloc error in eval_mm_speed");
             trace->blocks[index] = p;
             break;
@@ -815,9 +1485,10 @@ static void eval_mm_speed(void *ptr)
             break;
 
         case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            req_mm_free(&trace->ops[i], block);
             break;
 
 	default:
@@ -826,22 +1497,571 @@ static void eval_mm_speed(void *ptr)
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * eval_mm_check - Check the mm malloc package for correctness on one
+ *     trace, then measure its space utilization and count how often 
+ *     the heap grew during the utilization replay
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static void eval_mm_check(trace_t *trace, int tracenum, stats_t *stats)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+    range_t *ranges = NULL;
+    struct MM_Stats st;
 
-    for (i = 0;  i < trace->num_ops;  i++) {
-        switch (trace->ops[i].type) {
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, &ranges, &stats->rss);
+	mm_get_stats(&st);
+	stats->sbrks = st.sbrk_count;
+	stats->merges = st.sbrk_merged;
+    }
+    clear_ranges(&ranges);
+}
 
-        case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
+/*
+ * eval_mm_stats - Check the mm malloc package for correctness on one
+ *     trace, then measure its space utilization and speed. If workers
+ *     of -j have checked the trace already, only measure its speed.
+ */
+static void eval_mm_stats(trace_t *trace, int tracenum, stats_t *stats,
+			  int checked)
+{
+    speed_t speed_params;
+
+    stats->ops = trace->num_ops;
+    if (!checked)
+	eval_mm_check(trace, tracenum, stats);
+    else if (verbose > 1 && stats->valid)
+	printf("Measuring mm_malloc ");
+    if (stats->valid) {
+	speed_params.trace = trace;
+	speed_params.ranges = NULL;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+    }
+}
+
+/*
+ * check_worker - Body of worker w of eval_mm_parallel. Checks traces
+ *     w, w + njobs, ... and writes a check_t for each to fd.
+ */
+static void check_worker(char *tracedir, char **tracefiles, int n, 
+			 int njobs, int w, int fd)
+{
+    int i;
+    trace_t *trace;
+    stats_t stats;
+    check_t check;
+
+    mem_init();
+    for (i = w;  i < n;  i += njobs) {
+	errors = 0;
+	trace = read_trace(tracedir, tracefiles[i]);
+	memset(&stats, 0, sizeof(stats));
+	eval_mm_check(trace, i, &stats);
+	free_trace(trace);
+
+	check.tracenum = i;
+	check.valid = stats.valid;
+	check.errors = errors;
+	check.util = stats.util;
+	check.rss = stats.rss;
+	check.sbrks = stats.sbrks;
+	check.merges = stats.merges;
+	fflush(stdout);
+	if (write(fd, &check, sizeof(check)) != sizeof(check))
+	    break;
+    }
+}
+
+/*
+ * eval_mm_parallel - Check the mm malloc package for correctness and
+ *     space utilization on every trace, with njobs worker processes 
+ *     running at once. Each worker has a heap and an mm package of its
+ *     own, since it's a process of its own. Fills in ops, valid, util 
+ *     and rss of stats; a trace whose worker died is invalid.
+ */
+static void eval_mm_parallel(char *tracedir, char **tracefiles, int n,
+			     int njobs, stats_t *stats)
+{
+    int i, w, fds[2];
+    int *done;
+    check_t check;
+    pid_t pids[MAXJOBS];
+
+    if (njobs > n)
+	njobs = n;
+    if ((done = (int *)calloc(n, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_mm_parallel");
+    if (pipe(fds) < 0)
+	unix_error("pipe failed in eval_mm_parallel");
+    if (verbose > 1)
+	printf("Checking mm_malloc with %d workers.\n", njobs);
+
+    /* Don't let the workers print what's still buffered */
+    fflush(stdout);
+    for (w = 0;  w < njobs;  w++) {
+	if ((pids[w] = fork()) < 0)
+	    unix_error("fork failed in eval_mm_parallel");
+	if (pids[w] == 0) {
+	    close(fds[0]);
+	    verbose = (verbose > 1) ? 1 : verbose; /* keep progress quiet */
+	    check_worker(tracedir, tracefiles, n, njobs, w, fds[1]);
+	    fflush(stdout);
+	    _exit(0);
+	}
+    }
+    close(fds[1]);
+
+    /* Collect the results until every worker has closed the pipe */
+    while (read(fds[0], &check, sizeof(check)) == sizeof(check)) {
+	i = check.tracenum;
+	done[i] = 1;
+	stats[i].valid = check.valid;
+	stats[i].util = check.util;
+	stats[i].rss = check.rss;
+	stats[i].sbrks = check.sbrks;
+	stats[i].merges = check.merges;
+	errors += check.errors;
+    }
+    close(fds[0]);
+    for (w = 0;  w < njobs;  w++)
+	waitpid(pids[w], NULL, 0);
+
+    for (i = 0;  i < n;  i++) {
+	if (!done[i]) {
+	    errors++;
+	    stats[i].valid = 0;
+	    printf("ERROR [trace %d]: worker died while checking %s\n", 
+		   i, tracefiles[i]);
+	}
+    }
+    free(done);
+}
+
+/*
+ * print_frag_header - Write the column names of the -F file
+ */
+static void print_frag_header(FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "trace,op,heap_bytes,free_bytes,free_count,largest_free,"
+	    "frag,tree_height,black_height,adjacent_free,sbrk_count,"
+	    "sbrk_merged,chunk");
+    for (i = 0;  i < MM_STATS_BINS;  i++)
+	fprintf(fp, ",free_%lu", 16UL << i);
+    fprintf(fp, "\n");
+}
+
+/*
+ * eval_mm_frag - Replay a trace once more, writing the heap shape 
+ *     reported by mm_get_stats as a CSV row every num_ops/FRAG_SAMPLES 
+ *     ops and after the last one. mm_get_stats tours the whole heap, 
+ *     so it's kept out of the timed and checked replays.
+ */
+static void eval_mm_frag(trace_t *trace, int tracenum, FILE *fp)
+{
+    int i, j, index, interval;
+    char *p;
+    struct MM_Stats st;
+
+    interval = trace->num_ops / FRAG_SAMPLES;
+    if (interval < 1)
+	interval = 1;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_frag");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+        switch (trace->ops[i].type) {
+        case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+	    p = req_mm_alloc(&trace->ops[i]);
+	    break;
+	case REALLOC: /* mm_realloc */
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+        case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
+	    req_mm_free(&trace->ops[i], trace->blocks[index]);
+	    p = trace->blocks[index];
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_frag");
+	    p = NULL;
+	}
+	if (p == NULL)
+	    app_error("mm error in eval_mm_frag");
+	trace->blocks[index] = p;
+
+	if ((i + 1) % interval != 0 && i + 1 != trace->num_ops)
+	    continue;
+	mm_get_stats(&st);
+	fprintf(fp, "%d,%d,%lu,%lu,%lu,%lu,%.4f,%d,%d,%d,%lu,%lu,%lu", 
+		tracenum, i + 1,
+		(unsigned long)st.heap_bytes, (unsigned long)st.free_bytes, 
+		(unsigned long)st.free_count, (unsigned long)st.largest_free, 
+		st.frag, st.tree_height, st.black_height, st.adjacent_free,
+		st.sbrk_count, st.sbrk_merged, (unsigned long)st.chunk);
+	for (j = 0;  j < MM_STATS_BINS;  j++)
+	    fprintf(fp, ",%lu", (unsigned long)st.hist[j]);
+	fprintf(fp, "\n");
+    }
+}
+
+/*
+ * lat_ticks - Read the time stamp counter on x86, which is cheap enough
+ *     to bracket every op. lfence keeps earlier instructions from being
+ *     executed after the read. Elsewhere, return a monotonic time in ns.
+ */
+static inline unsigned long lat_ticks(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned hi, lo;
+
+    asm volatile("lfence; rdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+    return ((unsigned long long)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/*
+ * lat_bucket - Return the histogram bucket of latency v
+ */
+static int lat_bucket(unsigned long v)
+{
+    int e;
+
+    if (v < LAT_SUB)
+	return v;
+    e = 8 * sizeof(long) - 1 - __builtin_clzl(v);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + 
+	((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/*
+ * lat_bucket_hi - Return the highest latency that falls in bucket b
+ */
+static unsigned long lat_bucket_hi(int b)
+{
+    int e = b / LAT_SUB + LAT_SUB_BITS - 1;
+
+    if (b < LAT_SUB)
+	return b;
+    return ((unsigned long)(LAT_SUB + b % LAT_SUB + 1) << (e - LAT_SUB_BITS)) - 1;
+}
+
+/*
+ * lat_percentile - Return the q-th quantile of a histogram, rounded up
+ *     to the top of its bucket but never above the exact max
+ */
+static unsigned long lat_percentile(lat_hist_t *h, double q)
+{
+    unsigned long rank, seen = 0;
+    int b;
+
+    if (h->n == 0)
+	return 0;
+    rank = (unsigned long)(q * h->n);
+    if (rank < 1)
+	rank = 1;
+    for (b = 0;  b < LAT_BUCKETS;  b++) {
+	seen += h->count[b];
+	if (seen >= rank)
+	    break;
+    }
+    return (lat_bucket_hi(b) < h->max) ? lat_bucket_hi(b) : h->max;
+}
+
+/*
+ * lat_overhead - Return the least latency of an empty op, which is
+ *     taken off every timed op
+ */
+static unsigned long lat_overhead(void)
+{
+    unsigned long t, min = ~0UL;
+    int i;
+
+    for (i = 0;  i < 1000;  i++) {
+	t = lat_ticks();
+	t = lat_ticks() - t;
+	if (t < min)
+	    min = t;
+    }
+    return min;
+}
+
+/*
+ * eval_mm_latency - Replay a trace once more, timing every mm op on
+ *     its own into the histogram of its type. The timed replays of
+ *     eval_mm_speed are left alone, so -L doesn't change throughput.
+ */
+static void eval_mm_latency(trace_t *trace, lat_stats_t *stats)
+{
+    int i, index, type;
+    unsigned long start, t, overhead;
+    char *p;
+    lat_hist_t *h;
+
+    overhead = lat_overhead();
+    memset(stats, 0, sizeof(*stats));
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	type = trace->ops[i].type;
+
+	start = lat_ticks();
+        switch (type) {
+        case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+	    p = req_mm_alloc(&trace->ops[i]);
+	    type = ALLOC;
+	    break;
+	case REALLOC: /* mm_realloc */
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+        case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
+	    req_mm_free(&trace->ops[i], trace->blocks[index]);
+	    p = trace->blocks[index];
+	    type = FREE;
+	    break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+	    p = NULL;
+	}
+	t = lat_ticks() - start;
+
+	if (p == NULL)
+	    app_error("mm error in eval_mm_latency");
+	trace->blocks[index] = p;
+
+	t = (t > overhead) ? t - overhead : 0;
+	h = &stats->hist[type];
+	h->count[lat_bucket(t)]++;
+	h->n++;
+	if (t > h->max)
+	    h->max = t;
+    }
+    stats->valid = 1;
+}
+
+/*
+ * mt_usecs - Return a monotonic timestamp in usecs
+ */
+static double mt_usecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/*
+ * mt_cmp - qsort comparator for latencies
+ */
+static int mt_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * mt_percentile - Return the q-th quantile of the n sorted latencies
+ */
+static double mt_percentile(double *lat, int n, double q)
+{
+    return n ? lat[(int)(q * (n - 1))] : 0;
+}
+
+/*
+ * mt_replay - Thread routine of eval_mm_threads. Replays the requests
+ *     of the ids assigned to this thread, timing each of them. mm calls
+ *     are serialized by mm_lock if mm.c isn't thread-safe.
+ */
+static void *mt_replay(void *ptr)
+{
+    mt_thread_t *t = (mt_thread_t *)ptr;
+    trace_t *trace = t->trace;
+    int i, index, n = 0;
+    char *p;
+    double start;
+
+    pthread_barrier_wait(t->barrier);
+    t->start = mt_usecs();
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (index % t->nthreads != t->tid)
+	    continue;
+
+	start = mt_usecs();
+	if (mm_locked)
+	    pthread_mutex_lock(&mm_lock);
+        switch (trace->ops[i].type) {
+        case ALLOC: /* mm_malloc */
+        case CALLOC: /* mm_calloc */
+        case MEMALIGN: /* mm_memalign */
+	    p = req_mm_alloc(&trace->ops[i]);
+	    break;
+	case REALLOC: /* mm_realloc */
+	    p = mm_realloc(trace->blocks[index], trace->ops[i].size);
+	    break;
+        case FREE: /* mm_free */
+        case FREE_SIZED: /* mm_free_sized */
+	    req_mm_free(&trace->ops[i], trace->blocks[index]);
+	    p = trace->blocks[index];
+	    break;
+	default:
+	    app_error("Nonexistent request type in mt_replay");
+	    p = NULL;
+	}
+	if (mm_locked)
+	    pthread_mutex_unlock(&mm_lock);
+	t->lat[n++] = mt_usecs() - start;
+
+	if (p == NULL) {
+	    t->failed = 1;
+	    break;
+	}
+	trace->blocks[index] = p;
+    }
+
+    t->end = mt_usecs();
+    return NULL;
+}
+
+/*
+ * eval_mm_threads - Replay a trace with nthreads threads. The alloc ids 
+ *     of the trace are partitioned among the threads, so the threads 
+ *     together do the same work as one thread does. Keeps the fastest 
+ *     of MT_RUNS runs. Returns 0 if some mm call failed.
+ */
+static int eval_mm_threads(trace_t *trace, int nthreads, mt_stats_t *stats)
+{
+    int i, j, r, off;
+    double start, end, secs;
+    double *lat, *all;
+    unsigned long hits, misses;
+    pthread_t tids[MAXTHREADS];
+    mt_thread_t threads[MAXTHREADS];
+    pthread_barrier_t barrier;
+
+    if ((lat = (double *)malloc(trace->num_ops * sizeof(double))) == NULL ||
+	(all = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_threads");
+
+    /* Give each thread a slice of the latency array */
+    memset(threads, 0, sizeof(threads));
+    for (i = 0;  i < trace->num_ops;  i++)
+	threads[trace->ops[i].index % nthreads].nops++;
+    for (j = 0, off = 0;  j < nthreads;  off += threads[j++].nops) {
+	threads[j].trace = trace;
+	threads[j].tid = j;
+	threads[j].nthreads = nthreads;
+	threads[j].barrier = &barrier;
+	threads[j].lat = lat + off;
+    }
+
+    stats->valid = 1;
+    stats->ops = trace->num_ops;
+    stats->secs = DBL_MAX;
+    for (r = 0;  r < MT_RUNS && stats->valid;  r++) {
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0) 
+	    app_error("mm_init failed in eval_mm_threads");
+
+	pthread_barrier_init(&barrier, NULL, nthreads + 1);
+	for (j = 0;  j < nthreads;  j++)
+	    if (pthread_create(&tids[j], NULL, mt_replay, &threads[j]) != 0)
+		unix_error("pthread_create failed in eval_mm_threads");
+	pthread_barrier_wait(&barrier);
+	for (j = 0;  j < nthreads;  j++)
+	    pthread_join(tids[j], NULL);
+	pthread_barrier_destroy(&barrier);
+
+	/* Wall clock time from the first start to the last end */
+	start = DBL_MAX;
+	end = 0;
+	for (j = 0;  j < nthreads;  j++) {
+	    if (threads[j].failed)
+		stats->valid = 0;
+	    start = (threads[j].start < start) ? threads[j].start : start;
+	    end = (threads[j].end > end) ? threads[j].end : end;
+	}
+	secs = (end - start) / 1e6;
+
+	/* The threads have exited, so the cache counts are complete */
+	mm_tcache_stats(&hits, &misses);
+
+	/* Keep the latencies and cache counts of the fastest run */
+	if (secs < stats->secs) {
+	    stats->secs = secs;
+	    stats->hits = hits;
+	    stats->misses = misses;
+	    memcpy(all, lat, trace->num_ops * sizeof(double));
+	}
+    }
+
+    if (stats->valid) {
+	for (j = 0, off = 0;  j < nthreads;  off += threads[j++].nops) {
+	    qsort(all + off, threads[j].nops, sizeof(double), mt_cmp);
+	    stats->nops[j] = threads[j].nops;
+	    stats->thread_p50[j] = mt_percentile(all + off, threads[j].nops, 0.5);
+	    stats->thread_p99[j] = mt_percentile(all + off, threads[j].nops, 0.99);
+	    stats->thread_max[j] = mt_percentile(all + off, threads[j].nops, 1.0);
+	}
+	qsort(all, trace->num_ops, sizeof(double), mt_cmp);
+	stats->p50 = mt_percentile(all, trace->num_ops, 0.5);
+	stats->p99 = mt_percentile(all, trace->num_ops, 0.99);
+	stats->max = mt_percentile(all, trace->num_ops, 1.0);
+    }
+
+    free(lat);
+    free(all);
+    return stats->valid;
+}
+
+/*
+ * eval_libc_valid - We run this function to make sure that the
+ *    libc malloc can run to completion on the set of traces.
+ *    We'll be conservative and terminate if any libc malloc call fails.
+ *
+ */
+static int eval_libc_valid(trace_t *trace, int tracenum)
+{
+    int i, newsize;
+    char *p, *newp, *oldp;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* posix_memalign */
+	    if ((p = req_libc_alloc(&trace->ops[i])) == NULL) {
+		malloc_error(tracenum, i, "libc malloc failed");
 		unix_error("System message");
 	    }
 	    trace->blocks[trace->ops[i].index] = p;
@@ -858,6 +2078,7 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 	    break;
 	    
         case FREE: /* free */
+        case FREE_SIZED:
 	    free(trace->blocks[trace->ops[i].index]);
 	    break;
 
@@ -877,16 +2098,17 @@ static int eval_libc_valid(trace_t *trace, int tracenum)
 static void eval_libc_speed(void *ptr)
 {
     int i;
-    int index, size, newsize;
+    int index, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
+        case CALLOC: /* calloc */
+        case MEMALIGN: /* posix_memalign */
 	    index = trace->ops[i].index;
-	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
+	    if ((p = req_libc_alloc(&trace->ops[i])) == NULL)
 		unix_error("malloc failed in eval_libc_speed");
 	    trace->blocks[index] = p;
 	    break;
@@ -902,6 +2124,7 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	    
         case FREE: /* free */
+        case FREE_SIZED:
 	    index = trace->ops[i].index;
 	    block = trace->blocks[index];
 	    free(block);
@@ -910,6 +2133,344 @@ static void eval_libc_speed(void *ptr)
     }
 }
 
+/**********************************************************************
+ * The following routines replay a trace as a stream, for traces that
+ * don't fit in memory. A reader thread fills one buffer of requests 
+ * while the other is replayed, and only the live blocks are kept, in
+ * a hash table keyed by id.
+ **********************************************************************/
+
+/*
+ * live_find - Return the slot of id in the live table, which is either
+ *     the slot holding id or the empty slot where it would be inserted
+ */
+static live_t *live_find(live_t *table, size_t mask, int id)
+{
+    size_t i;
+
+    for (i = ((unsigned)id * 2654435761u) & mask;  
+	 table[i].id != -1 && table[i].id != id;  i = (i + 1) & mask)
+	;
+    return &table[i];
+}
+
+/*
+ * live_delete - Empty a slot of the live table. Following entries of
+ *     the same probe run are moved back, so lookups never need tombstones.
+ */
+static void live_delete(live_t *table, size_t mask, live_t *slot)
+{
+    size_t i, j, home;
+
+    i = slot - table;
+    for (j = (i + 1) & mask;  table[j].id != -1;  j = (j + 1) & mask) {
+	home = ((unsigned)table[j].id * 2654435761u) & mask;
+	/* the entry at j may move to i only if i lies in [home, j) */
+	if (((j - home) & mask) >= ((j - i) & mask)) {
+	    table[i] = table[j];
+	    i = j;
+	}
+    }
+    table[i].id = -1;
+}
+
+/*
+ * live_grow - Double the live table
+ */
+static live_t *live_grow(live_t *table, size_t *mask)
+{
+    size_t i, newmask = *mask * 2 + 1;
+    live_t *newtable;
+
+    if ((newtable = (live_t *)malloc((newmask + 1) * sizeof(live_t))) == NULL)
+	unix_error("malloc failed in live_grow");
+    for (i = 0;  i <= newmask;  i++)
+	newtable[i].id = -1;
+    for (i = 0;  i <= *mask;  i++)
+	if (table[i].id != -1)
+	    *live_find(newtable, newmask, table[i].id) = table[i];
+    free(table);
+    *mask = newmask;
+    return newtable;
+}
+
+/*
+ * stream_fill - Read up to n requests of the trace into buf. Returns
+ *     the number of requests read, which is 0 at the end of the trace.
+ */
+static int stream_fill(stream_t *s, traceop_t *buf, int n)
+{
+    char type[MAXLINE];
+    unsigned index, size, align;
+    int i;
+
+    if (s->binary)
+	return fread(buf, sizeof(traceop_t), n, s->file);
+
+    for (i = 0;  i < n && fscanf(s->file, "%s", type) != EOF;  i++) {
+	buf[i].size = 0;
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	case 'c':
+	case 's':
+	    if (fscanf(s->file, "%u %u", &index, &size) != 2)
+		app_error("Bogus request in streamed tracefile");
+	    buf[i].type = (type[0] == 'a') ? ALLOC : 
+		(type[0] == 'r') ? REALLOC : 
+		(type[0] == 'c') ? CALLOC : FREE_SIZED;
+	    buf[i].index = index;
+	    buf[i].size = size;
+	    break;
+	case 'm':
+	    if (fscanf(s->file, "%u %u %u", &index, &align, &size) != 3 ||
+		align == 0 || (align & (align - 1)) != 0)
+		app_error("Bogus request in streamed tracefile");
+	    buf[i].type = MEMALIGN;
+	    buf[i].index = index;
+	    buf[i].size = size;
+	    buf[i].align = align;
+	    break;
+	case 'f':
+	    if (fscanf(s->file, "%u", &index) != 1)
+		app_error("Bogus request in streamed tracefile");
+	    buf[i].type = FREE;
+	    buf[i].index = index;
+	    break;
+	default:
+	    sprintf(msg, "Bogus type character (%c) in streamed tracefile", 
+		    type[0]);
+	    app_error(msg);
+	}
+    }
+    return i;
+}
+
+/*
+ * stream_reader - Thread routine of a streaming replay. Fills the two 
+ *     buffers in turn, each as soon as the replay has drained it.
+ */
+static void *stream_reader(void *ptr)
+{
+    stream_t *s = (stream_t *)ptr;
+    int b, n;
+
+    for (b = 0;  ;  b ^= 1) {
+	pthread_mutex_lock(&s->lock);
+	while (s->full[b] && !s->stop)
+	    pthread_cond_wait(&s->cond, &s->lock);
+	pthread_mutex_unlock(&s->lock);
+	if (s->stop)
+	    break;
+
+	n = stream_fill(s, s->buf[b], STREAM_CHUNK);
+
+	pthread_mutex_lock(&s->lock);
+	s->count[b] = n;
+	s->full[b] = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	if (n == 0)
+	    break;
+    }
+    return NULL;
+}
+
+/*
+ * eval_stream - Replay the trace in path against mm (or libc, if libc
+ *     is set) while it's read, keeping only the live blocks. Checks
+ *     that every request succeeds with an aligned block, but not that
+ *     blocks don't overlap.
+ */
+static void eval_stream(char *path, int libc, stream_stats_t *stats)
+{
+    stream_t s;
+    pthread_t tid;
+    trace_hdr_t hdr;
+    live_t *table, *slot;
+    size_t i, mask = 65535, count = 0;
+    double start, t, live = 0, footprint;
+    traceop_t *op;
+    char *p;
+    int b, n;
+
+    memset(stats, 0, sizeof(*stats));
+    memset(&s, 0, sizeof(s));
+    if ((s.file = fopen(path, "r")) == NULL) {
+	sprintf(msg, "Could not open %s in eval_stream", path);
+	unix_error(msg);
+    }
+
+    /* Skip the header; its counts aren't needed */
+    if (fread(&hdr, sizeof(hdr), 1, s.file) == 1 && hdr.magic == TRACE_MAGIC)
+	s.binary = 1;
+    else {
+	rewind(s.file);
+	if (fscanf(s.file, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids, 
+		   &hdr.num_ops, &hdr.weight) != 4)
+	    app_error("Bogus header in streamed tracefile");
+    }
+
+    if ((s.buf[0] = malloc(2 * STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+	unix_error("malloc failed in eval_stream");
+    s.buf[1] = s.buf[0] + STREAM_CHUNK;
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.cond, NULL);
+    if ((table = (live_t *)malloc((mask + 1) * sizeof(live_t))) == NULL)
+	unix_error("malloc failed in eval_stream");
+    for (i = 0;  i <= mask;  i++)
+	table[i].id = -1;
+
+    if (verbose > 1)
+	printf("Streaming %s through %s malloc.\n", path, libc ? "libc" : "mm");
+    if (!libc) {
+	mem_reset_brk();
+	if (mm_init() < 0)
+	    app_error("mm_init failed in eval_stream");
+    }
+    if (pthread_create(&tid, NULL, stream_reader, &s) != 0)
+	unix_error("pthread_create failed in eval_stream");
+
+    stats->valid = 1;
+    start = mt_usecs();
+    for (b = 0;  stats->valid;  b ^= 1) {
+	t = mt_usecs();
+	pthread_mutex_lock(&s.lock);
+	while (!s.full[b])
+	    pthread_cond_wait(&s.cond, &s.lock);
+	pthread_mutex_unlock(&s.lock);
+	stats->wait += mt_usecs() - t;
+	if ((n = s.count[b]) == 0)
+	    break;
+
+	for (op = s.buf[b];  op < s.buf[b] + n;  op++) {
+	    slot = live_find(table, mask, op->index);
+	    switch (op->type) {
+	    case ALLOC:
+	    case CALLOC:
+	    case MEMALIGN:
+	    case REALLOC:
+		if (slot->id == -1 && count * 2 >= mask) {
+		    table = live_grow(table, &mask);
+		    slot = live_find(table, mask, op->index);
+		}
+		p = (slot->id == -1) ? NULL : slot->p;
+		if (op->type != REALLOC || p == NULL)
+		    p = libc ? req_libc_alloc(op) : req_mm_alloc(op);
+		else
+		    p = libc ? realloc(p, op->size) : mm_realloc(p, op->size);
+		if (p == NULL || !IS_ALIGNED(p)) {
+		    stats->valid = 0;
+		    break;
+		}
+		if (slot->id == -1) {
+		    slot->id = op->index;
+		    slot->size = 0;
+		    count++;
+		}
+		live += op->size - slot->size;
+		slot->size = op->size;
+		slot->p = p;
+		break;
+	    case FREE:
+	    case FREE_SIZED:
+		if (slot->id == -1 || 
+		    (op->type == FREE_SIZED && op->size != slot->size)) {
+		    stats->valid = 0;
+		    break;
+		}
+		if (libc)
+		    free(slot->p);
+		else
+		    req_mm_free(op, slot->p);
+		live -= slot->size;
+		live_delete(table, mask, slot);
+		count--;
+		break;
+	    default: /* broken binary trace */
+		stats->valid = 0;
+	    }
+	    if (!stats->valid) {
+		sprintf(msg, "%s malloc failed at request %.0f of %s", 
+			libc ? "libc" : "mm", stats->ops, path);
+		printf("ERROR: %s\n", msg);
+		/* memlib's heap can't grow beyond MAX_HEAP of config.h */
+		if (!libc)
+		    printf("ERROR: heap of mm is %lu bytes, and memlib limits "
+			   "it to MAX_HEAP, %lu bytes (see README)\n", 
+			   (unsigned long)mem_heapsize(), 
+			   (unsigned long)MAX_HEAP);
+		errors++;
+		break;
+	    }
+	    stats->ops++;
+	    if (live > stats->peak_live)
+		stats->peak_live = live;
+	    if (!libc) {
+		footprint = mem_heapsize() + mm_mapped_bytes();
+		if (footprint > stats->footprint)
+		    stats->footprint = footprint;
+	    }
+	}
+
+	pthread_mutex_lock(&s.lock);
+	s.full[b] = 0;
+	pthread_cond_broadcast(&s.cond);
+	pthread_mutex_unlock(&s.lock);
+    }
+    stats->secs = (mt_usecs() - start - stats->wait) / 1e6;
+    stats->wait /= 1e6;
+
+    /* Stop the reader in case the replay failed */
+    pthread_mutex_lock(&s.lock);
+    s.stop = 1;
+    pthread_cond_broadcast(&s.cond);
+    pthread_mutex_unlock(&s.lock);
+    pthread_join(tid, NULL);
+
+    /* Give back the blocks left live by libc; mm's heap is just reset */
+    for (i = 0;  libc && i <= mask;  i++)
+	if (table[i].id != -1)
+	    free(table[i].p);
+    free(table);
+    free(s.buf[0]);
+    pthread_mutex_destroy(&s.lock);
+    pthread_cond_destroy(&s.cond);
+    fclose(s.file);
+}
+
+/*
+ * print_stream_results - prints a summary of the streaming replays
+ */
+static void print_stream_results(char *path, stream_stats_t *mm, 
+				 stream_stats_t *libc)
+{
+    stream_stats_t *stats;
+    int i;
+
+    printf("\nResults of streaming %s:\n", path);
+    printf("%7s%7s%12s%10s%8s%9s%11s%11s%6s\n", 
+	   "malloc", " valid", "ops", "secs", "Kops", "wait(s)", 
+	   "live(KB)", "heap(KB)", "util");
+    for (i = 0;  i < 2;  i++) {
+	if ((stats = i ? libc : mm) == NULL)
+	    continue;
+	printf("%7s%7s%12.0f%10.3f%8.0f%9.3f%11.0f", 
+	       i ? "libc" : "mm",
+	       stats->valid ? "yes" : "no",
+	       stats->ops,
+	       stats->secs,
+	       (stats->ops / 1e3) / stats->secs,
+	       stats->wait,
+	       stats->peak_live / 1024);
+	if (stats->footprint > 0)
+	    printf("%11.0f%5.0f%%\n", stats->footprint / 1024, 
+		   stats->peak_live / stats->footprint * 100.0);
+	else
+	    printf("%11s%6s\n", "-", "-");
+    }
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -921,22 +2482,42 @@ static void eval_libc_speed(void *ptr)
 static void printresults(int n, stats_t *stats) 
 {
     int i;
+    int show_rss = 0;
+    int show_sbrks = 0;
     double secs = 0;
     double ops = 0;
     double util = 0;
 
+    /* Resident sizes and heap growths are only known for the mm package */
+    for (i=0; i < n; i++) {
+	if (stats[i].rss > 0)
+	    show_rss = 1;
+	if (stats[i].sbrks > 0)
+	    show_sbrks = 1;
+    }
+
     /* Print the individual results for each trace */
-    printf("%5s%7s %5s%8s%10s%6s\n", 
+    printf("%5s%7s %5s%8s%10s%6s", 
 	   "trace", " valid", "util", "ops", "secs", "Kops");
+    if (show_rss)
+	printf("%9s", "rss(KB)");
+    if (show_sbrks)
+	printf("%8s%8s", "sbrks", "merged");
+    printf("\n");
     for (i=0; i < n; i++) {
 	if (stats[i].valid) {
-	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f\n", 
+	    printf("%2d%10s%5.0f%%%8.0f%10.6f%6.0f", 
 		   i,
 		   "yes",
 		   stats[i].util*100.0,
 		   stats[i].ops,
 		   stats[i].secs,
 		   (stats[i].ops/1e3)/stats[i].secs);
+	    if (show_rss)
+		printf("%9.0f", stats[i].rss/1024);
+	    if (show_sbrks)
+		printf("%8.0f%8.0f", stats[i].sbrks, stats[i].merges);
+	    printf("\n");
 	    secs += stats[i].secs;
 	    ops += stats[i].ops;
 	    util += stats[i].util;
@@ -972,6 +2553,222 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * print_perf_results - prints the hardware events per op of each trace,
+ *     and over all traces, for some malloc package
+ */
+static void print_perf_results(int n, stats_t *stats, char *name)
+{
+    int i, j;
+    double ops = 0, total[FPERF_EVENTS];
+
+    for (j = 0;  j < FPERF_EVENTS;  j++)
+	total[j] = 0;
+
+    printf("Hardware events per op for %s malloc:\n", name);
+    printf("%5s", "trace");
+    for (j = 0;  j < FPERF_EVENTS;  j++)
+	printf("%12s", fperf_names[j]);
+    printf("\n");
+    for (i = 0;  i <= n;  i++) {
+	if (i < n && !stats[i].valid) {
+	    printf("%2d%15s", i, "-");
+	    for (j = 1;  j < FPERF_EVENTS;  j++)
+		printf("%12s", "-");
+	    printf("\n");
+	    continue;
+	}
+	if (i < n)
+	    printf("%2d   ", i);
+	else
+	    printf("%-5s", "Total");
+	for (j = 0;  j < FPERF_EVENTS;  j++) {
+	    if (i < n && stats[i].events[j] >= 0 && total[j] >= 0)
+		total[j] += stats[i].events[j];
+	    else if (i < n)
+		total[j] = -1;
+
+	    if (i < n && stats[i].events[j] >= 0)
+		printf("%12.3f", stats[i].events[j] / stats[i].ops);
+	    else if (i == n && total[j] >= 0 && ops > 0)
+		printf("%12.3f", total[j] / ops);
+	    else
+		printf("%12s", "-");
+	}
+	printf("\n");
+	if (i < n)
+	    ops += stats[i].ops;
+    }
+}
+
+/*
+ * print_lat_results - prints latency percentiles of malloc, free and
+ *     realloc for each trace, and over all traces
+ */
+static void print_lat_results(int n, lat_stats_t *stats)
+{
+    static char *names[3] = {"malloc", "free", "realloc"};
+    lat_hist_t total[3];
+    lat_hist_t *h;
+    int i, j, b;
+
+    memset(total, 0, sizeof(total));
+    printf("Latency of mm ops (%s):\n", LAT_UNIT);
+    printf("%5s%8s%9s%9s%9s%9s%11s\n", 
+	   "trace", "op", "ops", "p50", "p99", "p99.9", "max");
+    for (i = 0;  i <= n;  i++) {
+	if (i < n && !stats[i].valid) {
+	    printf("%2d%11s%9s%9s%9s%9s%11s\n", 
+		   i, "-", "-", "-", "-", "-", "-");
+	    continue;
+	}
+	for (j = 0;  j < 3;  j++) {
+	    h = (i < n) ? &stats[i].hist[j] : &total[j];
+	    if (h->n == 0)
+		continue;
+	    if (i < n)
+		printf("%2d", i);
+	    else
+		printf("%-5s", (j == 0) ? "Total" : "");
+	    printf("%*s%9lu%9lu%9lu%9lu%11lu\n", 
+		   (i < n) ? 11 : 8, names[j], h->n,
+		   lat_percentile(h, 0.5),
+		   lat_percentile(h, 0.99),
+		   lat_percentile(h, 0.999),
+		   h->max);
+
+	    /* Fold the trace into the totals */
+	    if (i < n) {
+		for (b = 0;  b < LAT_BUCKETS;  b++)
+		    total[j].count[b] += h->count[b];
+		total[j].n += h->n;
+		if (h->max > total[j].max)
+		    total[j].max = h->max;
+	    }
+	}
+    }
+}
+
+/*
+ * print_hitrate - Formats hits out of lookups as a percentage into buf,
+ *     or "-" if there were no lookups
+ */
+static void print_hitrate(char *buf, unsigned long hits, unsigned long lookups)
+{
+    if (lookups == 0)
+	strcpy(buf, "-");
+    else
+	sprintf(buf, "%.1f%%", hits * 100.0 / lookups);
+}
+
+/*
+ * print_mt_results - prints a summary of the threaded replays: aggregate
+ *     throughput with 1 and nthreads threads, scaling efficiency, 
+ *     latency percentiles (per thread with -v), and the hit rate of the 
+ *     thread caches ("-" if mm.c has none)
+ */
+static void print_mt_results(int n, int nthreads, 
+			     mt_stats_t *base, mt_stats_t *stats)
+{
+    int i, j;
+    double ops = 0, base_secs = 0, secs = 0, speedup;
+    unsigned long hits = 0, lookups = 0;
+    char hitrate[16];
+
+    printf("Results for mm malloc with %d threads (%s):\n", nthreads,
+	   mm_locked ? "mm calls serialized by a lock" : "thread-safe mm");
+    printf("%5s%9s%9s%8s%6s%9s%9s%9s%7s\n", 
+	   "trace", "Kops(1)", "Kops(T)", "speedup", "eff", 
+	   "p50(us)", "p99(us)", "max(us)", "tc-hit");
+    for (i = 0;  i < n;  i++) {
+	if (!base[i].valid || !stats[i].valid) {
+	    printf("%2d%12s%9s%8s%6s%9s%9s%9s%7s\n", 
+		   i, "-", "-", "-", "-", "-", "-", "-", "-");
+	    continue;
+	}
+	speedup = base[i].secs / stats[i].secs;
+	print_hitrate(hitrate, stats[i].hits, stats[i].hits + stats[i].misses);
+	printf("%2d%12.0f%9.0f%8.2f%5.0f%%%9.2f%9.2f%9.2f%7s\n", 
+	       i,
+	       (stats[i].ops / 1e3) / base[i].secs,
+	       (stats[i].ops / 1e3) / stats[i].secs,
+	       speedup,
+	       speedup / nthreads * 100.0,
+	       stats[i].p50,
+	       stats[i].p99,
+	       stats[i].max,
+	       hitrate);
+	ops += stats[i].ops;
+	hits += stats[i].hits;
+	lookups += stats[i].hits + stats[i].misses;
+	base_secs += base[i].secs;
+	secs += stats[i].secs;
+	if (verbose) {
+	    for (j = 0;  j < nthreads;  j++)
+		printf("%12s%2d%8d ops%21s%9.2f%9.2f%9.2f\n", 
+		       "thread", j, stats[i].nops[j], "",
+		       stats[i].thread_p50[j],
+		       stats[i].thread_p99[j],
+		       stats[i].thread_max[j]);
+	}
+    }
+    if (secs > 0) {
+	speedup = base_secs / secs;
+	print_hitrate(hitrate, hits, lookups);
+	printf("%12s%9.0f%9.0f%8.2f%5.0f%%%27s\n", 
+	       "Total       ",
+	       (ops / 1e3) / base_secs, 
+	       (ops / 1e3) / secs, 
+	       speedup, 
+	       speedup / nthreads * 100.0,
+	       hitrate);
+    }
+}
+
+/*
+ * print_defer_results - prints how deferred coalescing changes space
+ *     utilization (in points) and throughput (in percent) of each trace
+ */
+static void print_defer_results(int n, stats_t *base, stats_t *stats)
+{
+    int i;
+    double ops = 0, base_secs = 0, secs = 0, base_util = 0, util = 0;
+
+    printf("Deferred vs. immediate coalescing:\n");
+    printf("%5s%8s%8s%8s%9s%9s%8s\n", 
+	   "trace", "util(i)", "util(d)", "delta", "Kops(i)", "Kops(d)", "delta");
+    for (i = 0;  i < n;  i++) {
+	if (!base[i].valid || !stats[i].valid) {
+	    printf("%2d%11s%8s%8s%9s%9s%8s\n", 
+		   i, "-", "-", "-", "-", "-", "-");
+	    continue;
+	}
+	printf("%2d%10.0f%%%7.0f%%%+8.1f%9.0f%9.0f%+7.1f%%\n", 
+	       i,
+	       base[i].util * 100.0,
+	       stats[i].util * 100.0,
+	       (stats[i].util - base[i].util) * 100.0,
+	       (base[i].ops / 1e3) / base[i].secs,
+	       (stats[i].ops / 1e3) / stats[i].secs,
+	       (base[i].secs / stats[i].secs - 1.0) * 100.0);
+	ops += stats[i].ops;
+	base_secs += base[i].secs;
+	secs += stats[i].secs;
+	base_util += base[i].util;
+	util += stats[i].util;
+    }
+    if (secs > 0) {
+	printf("%5s%7.0f%%%7.0f%%%+8.1f%9.0f%9.0f%+7.1f%%\n", 
+	       "Total",
+	       base_util / n * 100.0,
+	       util / n * 100.0,
+	       (util - base_util) / n * 100.0,
+	       (ops / 1e3) / base_secs, 
+	       (ops / 1e3) / secs, 
+	       (base_secs / secs - 1.0) * 100.0);
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -1004,14 +2801,23 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValdLP] [-f <file>] [-t <dir>] [-T <n>] [-j <n>] [-F <csv>] [-S <file>]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-d         Compare with deferred coalescing of mm.c.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+    fprintf(stderr, "\t-F <csv>   Write heap shape samples of each trace to <csv>.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Check traces in n worker processes, then time them.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-L         Report latency percentiles of each mm op.\n");
+    fprintf(stderr, "\t-P         Count hardware events per op with perf_event_open.\n");
+    fprintf(stderr, "\t-S <file>  Stream <file> through mm (and libc with -l) only;\n");
+    fprintf(stderr, "\t           mm's heap is limited to MAX_HEAP (%luMB).\n", 
+	    (unsigned long)(MAX_HEAP >> 20));
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <n>     Replay each trace with 1 and n threads as well.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
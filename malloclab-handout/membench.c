@@ -0,0 +1,374 @@
+/*
+ * membench.c - Micro-benchmark of the copy and fill routines in mm.c
+ *
+ * Times the byte loops, the word loops, the SSE2/AVX2 versions and
+ * the dispatched mm_memcpy/mm_memset/mm_memmove against libc 
+ * memcpy/memset/memmove over a range of sizes and alignments, and 
+ * checks each of them against libc before timing. memmove is timed 
+ * 16 bytes down and up, the short overlap mm_realloc makes when it 
+ * slides a payload into a small free predecessor.
+ *
+ * Before that, it checks the slab caches of mm.c: small objects must
+ * keep their contents and take no more heap than mm_malloc takes for
+ * the same objects.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "fsecs.h"
+
+/* Same default as mm.c */
+#ifndef MM_SIMD
+#if defined(__i386__) || defined(__x86_64__)
+#define MM_SIMD 1
+#else
+#define MM_SIMD 0
+#endif
+#endif
+
+#define MAXBYTES  (1 << 20) /* largest size timed */
+#define MINBYTES  (1 << 22) /* bytes handled per timed call, at least */
+#define MAXOFFSET 64        /* misalignments checked */
+#define SLABOBJS  3000      /* objects allocated by check_slab */
+
+typedef void *(*copy_funct)(void *, void *, size_t);
+typedef void *(*fill_funct)(void *, int, size_t);
+
+typedef struct {
+    char *name;
+    copy_funct copy;
+    fill_funct fill;
+    copy_funct move;
+    int simd;          /* 0, 2 for SSE2, 3 for AVX2 */
+} impl_t;
+
+typedef struct {
+    impl_t *impl;
+    unsigned char *dst;
+    unsigned char *src;
+    size_t size;
+    int reps;
+} bench_t;
+
+static void *libc_memcpy(void *dst, void *src, size_t n)
+{
+    return memcpy(dst, src, n);
+}
+
+static void *libc_memmove(void *dst, void *src, size_t n)
+{
+    return memmove(dst, src, n);
+}
+
+int verbose = 0; /* fsecs.c reads it */
+
+static impl_t impls[] = {
+    {"byte",   mm_memcpy_byte, mm_memset_byte, mm_memmove_byte, 0},
+    {"word",   mm_memcpy_word, mm_memset_word, mm_memmove_word, 0},
+#if MM_SIMD
+    {"sse2",   mm_memcpy_sse2, mm_memset_sse2, mm_memmove_sse2, 2},
+    {"avx2",   mm_memcpy_avx2, mm_memset_avx2, mm_memmove_avx2, 3},
+#endif
+    {"mm",     mm_memcpy,      mm_memset,      mm_memmove,      0},
+    {"libc",   libc_memcpy,    memset,         libc_memmove,    0},
+};
+#define NUM_IMPLS (sizeof(impls) / sizeof(impls[0]))
+
+static size_t sizes[] = {16, 64, 136, 256, 1024, 4096, 65536, MAXBYTES};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+/* Object sizes checked by check_slab */
+static size_t slab_sizes[] = {8, 16, 48, 100, 128};
+#define NUM_SLAB_SIZES (sizeof(slab_sizes) / sizeof(slab_sizes[0]))
+
+static unsigned char dstbuf[MAXBYTES + 2 * MAXOFFSET];
+static unsigned char srcbuf[MAXBYTES + 2 * MAXOFFSET];
+static unsigned char refbuf[MAXBYTES + 2 * MAXOFFSET];
+
+/*
+ * supported - Return true if the running CPU can run impl
+ */
+static int supported(impl_t *impl)
+{
+#if MM_SIMD
+    __builtin_cpu_init();
+    if (impl->simd == 2)
+	return __builtin_cpu_supports("sse2");
+    if (impl->simd == 3)
+	return __builtin_cpu_supports("avx2");
+#endif
+    return 1;
+}
+
+/*
+ * check_impl - Compare impl with libc for every size below 512 and
+ *     the timed sizes, at every misalignment of dst and src, including
+ *     the guard bytes around the destination. memmove is compared 
+ *     within one buffer, moving down and up by every distance below 
+ *     MAXOFFSET. Returns 0 on mismatch.
+ */
+static int check_impl(impl_t *impl)
+{
+    size_t n, i, k;
+    int doff, soff, gap, up;
+    unsigned char *src;
+    size_t len = sizeof(dstbuf);
+
+    for (i = 0; i < len; i++)
+	srcbuf[i] = (unsigned char)(i * 7 + 3);
+
+    for (k = 0; k < 512 + NUM_SIZES; k++) {
+	n = (k < 512) ? k : sizes[k - 512];
+	for (doff = 0; doff < MAXOFFSET; doff += (n > 4096 ? 13 : 1)) {
+	    for (soff = 0; soff < MAXOFFSET; soff += (n > 512 ? 11 : 3)) {
+		memset(dstbuf, 0x5a, n + 2 * MAXOFFSET);
+		memset(refbuf, 0x5a, n + 2 * MAXOFFSET);
+		impl->copy(dstbuf + doff, srcbuf + soff, n);
+		memcpy(refbuf + doff, srcbuf + soff, n);
+		if (memcmp(dstbuf, refbuf, n + 2 * MAXOFFSET)) {
+		    printf("%s: memcpy mismatch (size %u, dst +%d, src +%d)\n",
+			   impl->name, (unsigned)n, doff, soff);
+		    return 0;
+		}
+	    }
+	    impl->fill(dstbuf + doff, 0xa5 + doff, n);
+	    memset(refbuf + doff, 0xa5 + doff, n);
+	    if (memcmp(dstbuf, refbuf, n + 2 * MAXOFFSET)) {
+		printf("%s: memset mismatch (size %u, dst +%d)\n",
+		       impl->name, (unsigned)n, doff);
+		return 0;
+	    }
+	}
+	for (gap = 1; gap < MAXOFFSET; gap += (n > 4096 ? 13 : 1)) {
+	    for (soff = 0; soff < 16; soff += 5) {
+		for (up = 0; up < 2; up++) {
+		    memcpy(dstbuf, srcbuf, n + 2 * MAXOFFSET);
+		    memcpy(refbuf, srcbuf, n + 2 * MAXOFFSET);
+		    src = (up ? dstbuf : dstbuf + MAXOFFSET) + soff;
+		    impl->move(up ? src + gap : src - gap, src, n);
+		    src = (up ? refbuf : refbuf + MAXOFFSET) + soff;
+		    memmove(up ? src + gap : src - gap, src, n);
+		    if (memcmp(dstbuf, refbuf, n + 2 * MAXOFFSET)) {
+			printf("%s: memmove mismatch (size %u, %s %d, src +%d)\n",
+			       impl->name, (unsigned)n, up ? "up" : "down", 
+			       gap, soff);
+			return 0;
+		    }
+		}
+	    }
+	}
+    }
+    return 1;
+}
+
+/*
+ * fill_objs - Allocate n objects of size bytes from cache, or with
+ *     mm_malloc if cache is NULL, and fill each with its own byte.
+ *     Every other object is freed and allocated again, so freed slots
+ *     are reused. Returns the heap bytes taken, or 0 if an object was
+ *     not allocated, is misaligned, or lost its contents.
+ */
+static size_t fill_objs(struct MM_Cache *cache, size_t size, 
+			unsigned char **objs, int n)
+{
+    int i, pass;
+    size_t j, heap;
+
+    heap = mem_heapsize();
+    for (pass = 0; pass < 2; pass++) {
+	for (i = 0; i < n; i++) {
+	    if (pass == 1 && i % 2 == 1)
+		continue;
+	    if (pass == 1) {
+		if (cache)
+		    mm_slab_free(cache, objs[i]);
+		else
+		    mm_free(objs[i]);
+	    }
+	    objs[i] = cache ? mm_slab_alloc(cache) : mm_malloc(size);
+	    if (objs[i] == NULL || (size_t)objs[i] % sizeof(void *) != 0)
+		return 0;
+	    memset(objs[i], i, size);
+	}
+    }
+    for (i = 0; i < n; i++)
+	for (j = 0; j < size; j++)
+	    if (objs[i][j] != (unsigned char)i)
+		return 0;
+    return mem_heapsize() - heap;
+}
+
+/*
+ * check_slab - Fill SLABOBJS objects of each size of slab_sizes from
+ *     a slab cache and with mm_malloc, and print the heap both take.
+ *     Returns 0 if objects were broken or the slabs took more heap.
+ */
+static int check_slab(void)
+{
+    static unsigned char *objs[SLABOBJS];
+    size_t i, slab, plain;
+    int ok = 1;
+
+    mem_init();
+    printf("Heap KB of %d objects\n", SLABOBJS);
+    printf("%8s %8s %8s\n", "size", "slab", "malloc");
+    for (i = 0; i < NUM_SLAB_SIZES; i++) {
+	mem_reset_brk();
+	mm_init();
+	slab = fill_objs(mm_slab_create(slab_sizes[i]), slab_sizes[i], 
+			 objs, SLABOBJS);
+	mem_reset_brk();
+	mm_init();
+	plain = fill_objs(NULL, slab_sizes[i], objs, SLABOBJS);
+
+	printf("%8u %8.1f %8.1f\n", (unsigned)slab_sizes[i], 
+	       slab / 1024.0, plain / 1024.0);
+	if (slab == 0 || plain == 0) {
+	    printf("slab: objects of size %u broken\n", 
+		   (unsigned)slab_sizes[i]);
+	    ok = 0;
+	}
+	else if (slab > plain) {
+	    printf("slab: objects of size %u take more heap than mm_malloc\n",
+		   (unsigned)slab_sizes[i]);
+	    ok = 0;
+	}
+    }
+    printf("\n");
+    return ok;
+}
+
+/*
+ * run_copy, run_fill, run_move - Test functions timed by fsecs
+ */
+static void run_copy(void *ptr)
+{
+    bench_t *b = (bench_t *)ptr;
+    int i;
+
+    for (i = 0; i < b->reps; i++)
+	b->impl->copy(b->dst, b->src, b->size);
+}
+
+static void run_fill(void *ptr)
+{
+    bench_t *b = (bench_t *)ptr;
+    int i;
+
+    for (i = 0; i < b->reps; i++)
+	b->impl->fill(b->dst, i, b->size);
+}
+
+static void run_move(void *ptr)
+{
+    bench_t *b = (bench_t *)ptr;
+    int i;
+
+    for (i = 0; i < b->reps; i++)
+	b->impl->move(b->dst, b->src, b->size);
+}
+
+/*
+ * gbytes_per_sec - Time f over b and return its throughput in GB/s
+ */
+static double gbytes_per_sec(fsecs_test_funct f, bench_t *b)
+{
+    double secs = fsecs(f, b);
+
+    return (double)b->size * b->reps / secs / 1e9;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: membench [-h] [-d <n>] [-s <n>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-d <n>     Misalign the destination by n bytes.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-s <n>     Misalign the source by n bytes.\n");
+}
+
+int main(int argc, char **argv)
+{
+    int c, ok = 1;
+    int doff = 0, soff = 0;
+    size_t i, j, k;
+    bench_t b, m;
+
+    while ((c = getopt(argc, argv, "d:s:h")) != EOF) {
+	switch (c) {
+	case 'd':
+	    doff = atoi(optarg) % MAXOFFSET;
+	    break;
+	case 's':
+	    soff = atoi(optarg) % MAXOFFSET;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+
+    init_fsecs();
+    if (!check_slab())
+	ok = 0;
+    for (j = 0; j < NUM_IMPLS; j++)
+	if (supported(&impls[j]) && !check_impl(&impls[j]))
+	    ok = 0;
+    if (!ok)
+	exit(1);
+
+    printf("GB/s (dst +%d, src +%d)\n", doff, soff);
+    printf("%8s %6s", "size", "op");
+    for (j = 0; j < NUM_IMPLS; j++)
+	printf(" %8s", impls[j].name);
+    printf("\n");
+
+    b.dst = dstbuf + doff;
+    b.src = srcbuf + soff;
+    for (i = 0; i < NUM_SIZES; i++) {
+	b.size = sizes[i];
+	b.reps = (sizes[i] < MINBYTES) ? MINBYTES / sizes[i] : 1;
+
+	printf("%8u %6s", (unsigned)b.size, "memcpy");
+	for (j = 0; j < NUM_IMPLS; j++) {
+	    b.impl = &impls[j];
+	    if (supported(b.impl))
+		printf(" %8.2f", gbytes_per_sec(run_copy, &b));
+	    else
+		printf(" %8s", "-");
+	}
+	printf("\n%8s %6s", "", "memset");
+	for (j = 0; j < NUM_IMPLS; j++) {
+	    b.impl = &impls[j];
+	    if (supported(b.impl))
+		printf(" %8.2f", gbytes_per_sec(run_fill, &b));
+	    else
+		printf(" %8s", "-");
+	}
+	printf("\n");
+
+	/* Move 16 bytes down, then up, within the destination buffer */
+	for (k = 0; k < 2; k++) {
+	    m = b;
+	    m.src = dstbuf + 16 + doff;
+	    m.dst = k ? m.src + 16 : m.src - 16;
+	    printf("%8s %6s", "", k ? "mv+16" : "mv-16");
+	    for (j = 0; j < NUM_IMPLS; j++) {
+		m.impl = &impls[j];
+		if (supported(m.impl))
+		    printf(" %8.2f", gbytes_per_sec(run_move, &m));
+		else
+		    printf(" %8s", "-");
+	    }
+	    printf("\n");
+	}
+    }
+    exit(0);
+}
@@ -2,6 +2,11 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ *            With USE_MMAP_HEAP, the heap is a region of address space 
+ *            reserved with mmap and committed lazily as the brk grows.
+ *            Pages above a shrinking brk and pages passed to mem_release 
+ *            are returned to the kernel.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -18,20 +23,48 @@
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_max_brk;    /* high water mark of mem_brk */
+#if USE_MMAP_HEAP
+static char *mem_commit_brk; /* end of the pages committed so far */
+#endif
+
+/* round addr up/down to a page boundary */
+#define PAGE_UP(addr)   ((char *)(((size_t)(addr) + mem_pagesize() - 1) & \
+				 ~(mem_pagesize() - 1)))
+#define PAGE_DOWN(addr) ((char *)((size_t)(addr) & ~(mem_pagesize() - 1)))
+
+/* with USE_MMAP_HEAP, pages are committed in units of this many bytes */
+#define COMMIT_UNIT (1<<16)
+#define COMMIT_UP(addr) (mem_start_brk + \
+			 (((addr) - mem_start_brk + COMMIT_UNIT - 1) & \
+			  ~(COMMIT_UNIT - 1)))
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+#if USE_MMAP_HEAP
+    /* reserve the address space; pages are committed by mem_sbrk */
+    mem_start_brk = (char *)mmap(NULL, MAX_HEAP, PROT_NONE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, 
+				 -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+    mem_commit_brk = mem_start_brk;
+#else
     /* allocate the storage we will use to model the available VM */
     if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_brk = mem_brk;
 }
 
 /* 
@@ -39,7 +72,11 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
+#if USE_MMAP_HEAP
+    munmap(mem_start_brk, MAX_HEAP);
+#else
     free(mem_start_brk);
+#endif
 }
 
 /*
@@ -47,27 +84,86 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+#if USE_MMAP_HEAP
+    /* decommit every page so the next trace starts from scratch */
+    if (mem_commit_brk > mem_start_brk) {
+	madvise(mem_start_brk, mem_commit_brk - mem_start_brk, MADV_DONTNEED);
+	mprotect(mem_start_brk, mem_commit_brk - mem_start_brk, PROT_NONE);
+    }
+    mem_commit_brk = mem_start_brk;
+#endif
     mem_brk = mem_start_brk;
+    mem_max_brk = mem_brk;
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap; with USE_MMAP_HEAP the pages 
+ *    above the new brk are returned to the kernel.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
+#if USE_MMAP_HEAP
+    char *commit_brk;
+#endif
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (mem_brk + incr < mem_start_brk) || 
+	 ((mem_brk + incr) > mem_max_addr)) {
 	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory "
+		"(MAX_HEAP is %lu bytes)...\n", (unsigned long)MAX_HEAP);
 	return (void *)-1;
     }
+
+#if USE_MMAP_HEAP
+    commit_brk = COMMIT_UP(mem_brk + incr);
+    if (commit_brk > mem_commit_brk) {
+	/* commit the pages the heap grows into */
+	if (mprotect(mem_commit_brk, commit_brk - mem_commit_brk, 
+		     PROT_READ | PROT_WRITE) < 0) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed. mprotect error...\n");
+	    return (void *)-1;
+	}
+	mem_commit_brk = commit_brk;
+    }
+    else if (commit_brk < mem_commit_brk) {
+	/* decommit the pages left above the shrunk heap */
+	madvise(commit_brk, mem_commit_brk - commit_brk, MADV_DONTNEED);
+	mprotect(commit_brk, mem_commit_brk - commit_brk, PROT_NONE);
+	mem_commit_brk = commit_brk;
+    }
+#endif
+
     mem_brk += incr;
+    if (mem_brk > mem_max_brk)
+	mem_max_brk = mem_brk;
     return (void *)old_brk;
 }
 
+/*
+ * mem_release - tell the memory system that the heap bytes [lo, lo+len)
+ *    are free and need not be kept. With USE_MMAP_HEAP the pages lying
+ *    entirely inside the range are returned to the kernel and read back
+ *    as zeros. Returns the number of bytes released.
+ */
+size_t mem_release(void *lo, size_t len)
+{
+#if USE_MMAP_HEAP
+    char *start = PAGE_UP(lo);
+    char *end = PAGE_DOWN((char *)lo + len);
+
+    if (end <= start)
+	return 0;
+    if (madvise(start, end - start, MADV_DONTNEED) < 0)
+	return 0;
+    return (size_t)(end - start);
+#else
+    return 0;
+#endif
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +188,44 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_heapsize_max() - returns the high water mark of the heap size 
+ *    in bytes since the last mem_reset_brk
+ */
+size_t mem_heapsize_max() 
+{
+    return (size_t)(mem_max_brk - mem_start_brk);
+}
+
+/*
+ * mem_resident() - returns the number of heap bytes resident in 
+ *    physical memory. Only USE_MMAP_HEAP decommits the pages on 
+ *    mem_reset_brk, so without it pages touched by earlier runs would 
+ *    be counted, and 0 is returned instead.
+ */
+size_t mem_resident()
+{
+#if USE_MMAP_HEAP
+    char *start = PAGE_DOWN(mem_start_brk);
+    size_t i, npages, count = 0;
+    unsigned char *vec;
+
+    npages = (PAGE_UP(mem_brk) - start) / mem_pagesize();
+    if (npages == 0)
+	return 0;
+    if ((vec = (unsigned char *)malloc(npages)) == NULL)
+	return 0;
+    if (mincore(start, npages * mem_pagesize(), vec) == 0) {
+	for (i = 0; i < npages; i++)
+	    count += vec[i] & 1;
+    }
+    free(vec);
+    return count * mem_pagesize();
+#else
+    return 0;
+#endif
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
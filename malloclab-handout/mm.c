@@ -2,25 +2,53 @@
  * mm.c
  * 
  * In mm.c, the program is maintaining two data structures. Every memory segment is stored in double-linked list. Every free memory segment is stored in red-black tree.
- * Every memory segment has 12Byte header and 4Byte footer. Header contains segment's size, flag bits, pointer to left and right children in red-black tree. Since size field is defined 29bit, value is stored in unit of ALIGNMENT. For efficiency, left and right field are used only when segment is free, and used by user when allocated.
+ * Every memory segment has 12Byte header and 4Byte footer. Header contains segment's size, flag bits, pointer to left and right children in red-black tree. Since size field is defined 29bit, value is stored in unit of 8Byte. For efficiency, left and right field are used only when segment is free, and used by user when allocated.
  * Because every memory allocated to user should be 8Byte aligned, 4Byte footer of previous segment is considered as leading field of following segment. Footer contains pointer to Header.
+ * Pointers in segments are stored as 32bit references relative to beginning of heap, in unit of 8Byte. So layout above is same on 32bit and 64bit, and heap can grow up to 32GByte.
  *
- * When mm_malloc is called, program first searches in red-black tree, which keyed with segment's size. If there is free segment bigger than requested size, program returns it's pointer. Else, program calls mem_sbrk() and returns it.
- * When mm_free is called, program looks previous and next segments if they are free os they can coalesced. Resulting segment is inserted into red-black tree.
- * When mm_realloc is called, there are three cases: segment shrinks, expands, re-alloceted. Requested segment is expanded when following segment is available.
+ * Small segments (up to 128Byte payload) have exact-fit singly linked free lists in front of the red-black tree. Segments in those lists keep their alloc bit, so push and pop are O(1) without any tree operation.
+ * When mm_malloc is called, program first pops exact-fit free list if size is small. Else, program searches in red-black tree, which keyed with segment's size. If there is free segment bigger than requested size, program returns it's pointer. Else, free lists are flushed into red-black tree and searched again, and finally program calls mem_sbrk() and returns it.
+ * When mm_free is called, small segment is pushed into free list. Else, program looks previous and next segments if they are free os they can coalesced. Resulting segment is inserted into red-black tree.
+ * Defining MM_DEFER as 1, or calling mm_set_deferred(1), defers coalescing of other segments too. They're pushed into unsorted double-linked list, tagged with null bit while keeping alloc bit, and list is swept when it holds MM_DEFER_MAX segments or red-black tree can't satisfy request. Sweep merges runs of adjacent deferred segments by unlinking them from list, so each run costs one tree insertion.
+ * When mm_realloc is called, there are three cases: segment shrinks, expands, re-alloceted. Requested segment is expanded when following segment is available. Else, if previous segment is free and big enough with following ones, they're coalesced and payload is moved down with mm_memmove; heap grows only when neither side is enough.
+ * Segment grown for second time gets headroom of 1/64 of its size, so repeatedly grown segment is expanded or moved only once per 1/64 of growth. Color bit, which is unused while segment is allocated, marks segment grown before. Only one segment keeps its headroom; headroom goes back to red-black tree when other segment starts growing, segment shrinks, or heap can't satisfy request.
+ * Big free segment at the end of heap is given back with negative mem_sbrk(), and pages inside other big free segments are released with mem_release().
+ * Defining MM_MMAP as 1 allocates huge segment (128KByte or more) in its own mapping instead of heap, so it doesn't raise high water mark of heap. Its header is tagged with null bit and clear alloc bit, which no segment in heap has, and mm_realloc resizes it with mremap() instead of copying. Mappings are linked in list, so mm_mapped_range can tell if block is in one of them without reading its header.
+ *
+ * mm_memcpy and mm_memset copy and fill with machine words after aligning destination. mm_memmove copies same words forward or backward, loading each group before storing it, so overlapping payload moves at the speed of mm_memcpy however short the distance is. On x86, SSE2 or AVX2 versions are selected by CPU at first call; defining MM_SIMD as 0 keeps word versions only.
  *
  * For efficiency, program calls mem_sbrk() with bigger than certain size. Some segments might not coalesced temporarily, but integrity of linked list is maintained since list points adjacents segments.
+ * When heap grows for mm_malloc and the last segment of heap is free, heap grows only by the rest and they're merged. Growth is adaptive: while little of list is free, heap is reserved ahead by chunk which doubles up to 1/64 of list, so allocation bursts call mem_sbrk() less often; once free segments pile up, chunk collapses. Reserved heap stays beyond end of list and list grows into it by bumping, so layout of segments is same as without chunk. Defining MM_CHUNK as 0 grows heap only as needed.
+ * Defining MM_ALIGNMENT as 16 aligns every payload to 16Byte, as x86-64 ABI expects from system allocator. Sizes of segments are rounded to 16Byte and segments begin at 8Byte past 16Byte boundary, so header stays 8Byte; size field and references keep their unit.
  * Program uses no global variables. There is a data field contains pointer to root node and things in header of heap. All other datas are stored in heap or stack.
  * There are no data-sensitive procedure; every optimization can be applied to any general inputs. I think it worth bonus points.
  * 
  * I wrote all implementations below including operations of red-black tree. I don't think comments are required about red-black tree implementations. Those are based on documentation http://en.wikipedia.org/wiki/Rbtree.
+ * Free segments are split into size bins like TLSF, and each bin has its own red-black tree. Two-level bitmap tells which bins are non-empty, so if bin of requested size has nothing fits, least segment of next non-empty bin is found with two bit scans and walk to leftmost node. Defining MM_BITMAP as 0 keeps single red-black tree.
+ * Red-black tree operations are recursive by default. Defining MM_RBTREE_ITERATIVE as 1 selects iterative top-down insertion and deletion, which use single pass from root without parent pointers or stack.
+ *
+ * Defining MM_ARENA as 1 makes mm_malloc, mm_free and mm_realloc thread-safe. Heap begins with header of arenas, and up to MM_ARENA_COUNT arenas are carved from heap. Each arena has its own data field, red-black tree, free lists and lock. Threads are bound to arenas in round-robin order. Arena takes nothing more than its data field when it's carved, and grows in place while it's at the top of heap; once other arena is above it, it continues in new span at the top, reserving ahead so arenas growing in turn chain few spans.
+ * Segment freed by thread bound to other arena is pushed into lock-free stack of its owner, and owner frees them next time it takes its lock. So threads never take lock of other arena.
+ * Defining MM_TCACHE as 1 adds per-thread cache of small segments in front of arenas. Hot pairs of mm_malloc and mm_free are served from cache without lock; cache is refilled and flushed in batches under lock of arena.
+ * mm_lock_all and mm_unlock_all hold every lock across fork(), including those of slab caches, so preloaded build in mmshim.c can be used by programs that fork while other threads allocate.
+ * mm_calloc zeroes array unless it's fresh mapping. mm_memalign allocates with room for alignment, and leading slack goes back to red-black tree as free segment. mm_free_sized takes size last requested for segment, which tells which bin of cache it goes to, so header isn't decoded for small ones; only huge ones are checked for mapped tag.
+ *
+ * mm_get_stats reports shape of heap: histogram of free segment sizes, largest one, external fragmentation, heights of red-black trees and adjacent free segments not coalesced yet.
+ * Objects of fixed size can be allocated from slab cache made by mm_slab_create. Slab is segment of one page, aligned to page so slab of object is found by masking its address; its payload is one header short of page, so header of next segment ends the page and slabs carved one after another tile heap without gaps. Slab begins with bitmap of free objects and objects follow without headers. Slabs with free objects are kept in double-linked list of their cache, and empty slab is freed back to red-black tree unless it's the last one with free objects. Objects bigger than MM_SLAB_OBJ_MAX are allocated with mm_malloc.
  * 
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #include "mm.h"
 #include "memlib.h"
@@ -38,12 +66,26 @@ team_t team = {
 	""
 };
 
-#define ALIGNMENT 			8
-#define ALIGN(size)			(((size) + (0x7)) & (~0x7))
+// payload alignment, 8 or 16 for alignof(max_align_t) of x86-64 (make MMFLAGS=-DMM_ALIGNMENT=16); size field and references stay in unit of 8Byte
+#ifndef MM_ALIGNMENT
+#define MM_ALIGNMENT		8
+#endif
+#define ALIGNMENT 			MM_ALIGNMENT
+#define ALIGN(size)			(((size) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
 
 #define MM_ALIGN			3
-#define MM_ARCH				32
+#define MM_SIZE_MAX			(((((size_t)1 << (32 - MM_ALIGN)) - 1) << MM_ALIGN) & ~(size_t)(ALIGNMENT - 1))
+#define MM_HEAP_MAX			((unsigned long long)1 << (32 + MM_ALIGN))
 #define MM_UNIT				144
+#define MM_RELEASE			(256 << 10)
+#define MM_TRIM				(128 << 10)
+
+// 1 for serving huge requests from their own mappings (make MMFLAGS=-DMM_MMAP=1)
+#ifndef MM_MMAP
+#define MM_MMAP				0
+#endif
+#define MM_MMAP_THRESHOLD	(128 << 10)
+#define MM_MAP_PAD			(ALIGN(sizeof(struct MM_Map) + MM_HEADER_SIZE) - MM_HEADER_SIZE)	// links of mapping, then header of its segment, so payload is aligned
 
 #define MM_ALLOC_FREE		0
 #define MM_ALLOC_ALLOC		1
@@ -51,38 +93,296 @@ team_t team = {
 #define MM_COLOR_RED		1
 #define MM_NULL_NOTNULL		0
 #define MM_NULL_NULL		1
+// color bit is meaningless while segment is allocated; it marks segment grown by mm_realloc
+#define MM_GROW_GROWN		1
+#define MM_GROW_SHIFT		6	// headroom is size >> MM_GROW_SHIFT
+
+// 1 for deferring coalescing of freed segments (make MMFLAGS=-DMM_DEFER=1); mm_set_deferred changes it at run time
+#ifndef MM_DEFER
+#define MM_DEFER			0
+#endif
+#define MM_DEFER_MAX		32
+
+// 1 for adaptive growth of heap, doubling chunk during allocation bursts, 0 for growth only as needed (make MMFLAGS=-DMM_CHUNK=0)
+#ifndef MM_CHUNK
+#define MM_CHUNK			1
+#endif
+#define MM_CHUNK_UTIL		3	// chunk grows while at most 1/8 of list is free
+#define MM_CHUNK_SHIFT		6	// and stays within 1/64 of list, so heap reserved ahead costs little utilization
+#define MM_CHUNK_MAX		(1 << 20)
+
+#define MM_SLAB_SIZE		4096
+#define MM_SLAB_PAYLOAD		(MM_SLAB_SIZE - MM_HEADER_SIZE)	// header of next segment ends the page, so slabs tile heap
+#define MM_SLAB_OBJ_MAX		512
+#define MM_SLAB_ALIGN		8	// objects are rounded to it; those of size multiple of ALIGNMENT stay aligned to it
+#define MM_SLAB_MAP			(MM_SLAB_SIZE / MM_SLAB_ALIGN / 32)
+
+// 1 for iterative top-down red-black tree operations, 0 for recursive ones (make MMFLAGS=-DMM_RBTREE_ITERATIVE=1)
+#ifndef MM_RBTREE_ITERATIVE
+#define MM_RBTREE_ITERATIVE	0
+#endif
+
+// 1 for per-thread cache of small segments; implies MM_ARENA (make MMFLAGS=-DMM_TCACHE=1)
+#ifndef MM_TCACHE
+#define MM_TCACHE			0
+#endif
+#define MM_TCACHE_MAX		16
+#define MM_TCACHE_BATCH		8
+
+// 1 for thread-safe mode with per-thread arenas (make MMFLAGS=-DMM_ARENA=1)
+#ifndef MM_ARENA
+#define MM_ARENA			MM_TCACHE
+#endif
+#ifndef MM_ARENA_COUNT
+#define MM_ARENA_COUNT		4
+#endif
+#ifndef MM_ARENA_SIZE
+#define MM_ARENA_SIZE		(4 << 20)	// most arena reserves ahead for new span
+#endif
+#define MM_ARENA_STEP		(64 << 10)	// least it reserves; doubles up to MM_ARENA_SIZE
+#ifndef MM_SPAN_COUNT
+#define MM_SPAN_COUNT		128	// spans in header of arenas; array moves into heap, doubling, when they're used up
+#endif
+
+#if MM_TCACHE && !MM_ARENA
+#error "MM_TCACHE requires MM_ARENA"
+#endif
+
+// 1 for two-level bitmap of size bins in front of red-black trees, 0 for single red-black tree (make MMFLAGS=-DMM_BITMAP=0)
+#ifndef MM_BITMAP
+#define MM_BITMAP			1
+#endif
+#define MM_SL_SHIFT			2
+#define MM_SL_COUNT			(1 << MM_SL_SHIFT)
+#define MM_FL_COUNT			20
+
+// 1 for SSE2/AVX2 versions of mm_memcpy and mm_memset selected at run time, 0 for word-at-a-time ones (make MMFLAGS=-DMM_SIMD=0)
+#ifndef MM_SIMD
+#if defined(__i386__) || defined(__x86_64__)
+#define MM_SIMD				1
+#else
+#define MM_SIMD				0
+#endif
+#endif
+
+#define MM_LINK(now, dir)	mm_node((dir) ? (now)->right : (now)->left)
+#define MM_LEFT(now)		mm_node((now)->left)
+#define MM_RIGHT(now)		mm_node((now)->right)
+#define MM_PREV(now)		mm_node((now)->prev)
+#define MM_IS_RED(now)		((now)->color == MM_COLOR_RED)
 
 #define MM_HEADER_SIZE		8
 #define MM_NODE_SIZE		16
-#define MM_DATA_SIZE		24
+// segments begin right after data field, and their payloads must be aligned
+#define MM_DATA_SIZE		(ALIGN(sizeof(struct MM_Data) + MM_HEADER_SIZE) - MM_HEADER_SIZE)
+#define MM_ARENAS_SIZE		ALIGN(sizeof(struct MM_Arenas))
+
+#define MM_SMALL_MIN		(MM_NODE_SIZE >> MM_ALIGN)
+#define MM_SMALL_MAX		(ALIGN(128 + MM_HEADER_SIZE) >> MM_ALIGN)
+#define MM_SMALL_COUNT		(MM_SMALL_MAX - MM_SMALL_MIN + 1)
 
 /* 
  * MM_Node
  * Header for every memory segment. Prev is footer of previous segment. Member left, right is avaliable only if segment is free.
+ * Prev, left and right are 32bit references instead of pointers: offset from beginning of heap in unit of ALIGNMENT, 0 for NULL. So node is 16Byte on both 32bit and 64bit, and heap can grow up to 32GByte.
  */
 struct MM_Node
 {
-	struct MM_Node *		prev;
-	size_t					size:	MM_ARCH - MM_ALIGN;
+	unsigned int			prev;
+	unsigned int			size:	32 - MM_ALIGN;
 	unsigned int			alloc:	1;
 	unsigned int			color:	1;
 	unsigned int			null:	1;
-	struct MM_Node *		left;
-	struct MM_Node *		right;
+	unsigned int			left;
+	unsigned int			right;
+};
+
+/* 
+ * MM_Map
+ * Links at the beginning of mapping of huge segment, in list of mappings headed in data field, or in header of arenas in arena mode.
+ */
+struct MM_Map
+{
+	struct MM_Map *			prev;
+	struct MM_Map *			next;
 };
 
 /* 
  * MM_Data
- * Use one MM_Data in heap instead of global variables.
+ * Use one MM_Data in heap instead of global variables. With bitmap, bin is array of references to roots of red-black trees, one per size bin; bit of sl_map is set if bin is non-empty, and bit of fl_map is set if sl_map is non-zero. Small is array of heads of exact-fit free lists for small segments. Defer is head of unsorted list of segments waiting for coalescing, and defer_count is its length. Grow is last segment given headroom by mm_realloc, and grow_size is size requested for it. Brk is end of list and end is end of heap reserved for it, so list grows by bumping brk until it reaches end. Chunk is how far heap is reserved ahead of list, heap_bytes is size of segments in list and free_bytes is size of those in red-black tree, exact-fit free lists and deferred list; sbrk_count and sbrk_merged count growths of heap and growths of list merged with free segment at the end of it.
+ * In arena mode, every arena has its own MM_Data at beginning of its first span. Lock protects the arena, brk and end bound its last span, reserve is size it reserves ahead for next span, and remote is lock-free stack of segments freed by threads bound to other arenas.
  */
 struct MM_Data
 {
+#if MM_BITMAP
+	unsigned int			fl_map;
+	unsigned int			sl_map[MM_FL_COUNT];
+	unsigned int			bin[MM_FL_COUNT][MM_SL_COUNT];
+#else
 	struct MM_Node *		root;
-	struct MM_Node 			null;
+#endif
+	struct MM_Node 			null __attribute__((aligned(ALIGNMENT)));
+	struct MM_Node *		small[MM_SMALL_COUNT];
+	struct MM_Node *		defer;
+	unsigned int			defer_count;
+	struct MM_Node *		grow;
+	size_t					grow_size;
+	char *					brk;
+	char *					end;
+	size_t					chunk;
+	size_t					heap_bytes;
+	size_t					free_bytes;
+	unsigned long			sbrk_count;
+	unsigned long			sbrk_merged;
+#if MM_ARENA
+	pthread_mutex_t			lock;
+	size_t					reserve;
+	struct MM_Node * volatile	remote;
+#else
+	size_t					mapped;
+	struct MM_Map *			maps;
+#endif
+};
+
+/* 
+ * MM_Arenas
+ * Header of heap in arena mode. Arena is list of spans, contiguous parts of heap each with its own list of segments ending with header of size 0. Span grows in place while it's at the top of heap; else arena chains new span at the top. Spans are carved in order of address, so span array, which holds reference of first segment of span and index of its arena, is sorted by address and owner of segment is found from it. Span array begins in span_head; when it's full, it's copied into twice as large one at the top of heap. Old array is never reused, so it stays valid for readers without lock.
+ */
+struct MM_Span
+{
+	unsigned int			span;
+	unsigned int			arena;
+};
+
+struct MM_Arenas
+{
+	pthread_mutex_t			lock;
+	int						next;
+	int						count;
+	struct MM_Data *		arena[MM_ARENA_COUNT];
+	int						spans;
+	int						span_max;
+	struct MM_Span *		span;
+	struct MM_Span			span_head[MM_SPAN_COUNT];
+	unsigned long			hits;
+	unsigned long			misses;
+	size_t					mapped;
+	struct MM_Map *			maps;
+	struct MM_Cache *		caches;
+};
+
+/* 
+ * MM_Tcache
+ * Per-thread cache of small segments. Bins are exact-fit like free lists of data field, but they're accessed without lock. Hits and misses are added to MM_Arenas on every miss.
+ */
+struct MM_Tcache
+{
+	unsigned int			epoch;
+	unsigned int			count[MM_SMALL_COUNT];
+	struct MM_Node *		bin[MM_SMALL_COUNT];
+	unsigned long			hits;
+	unsigned long			misses;
+};
+
+/* 
+ * MM_Slab
+ * Header at the beginning of slab. Cache is reference of its cache, next and prev link slabs with free objects, and count is number of allocated objects. Bit of map is set if object is free.
+ */
+struct MM_Slab
+{
+	unsigned int			cache;
+	unsigned int			next;
+	unsigned int			prev;
+	unsigned int			count;
+	unsigned int			map[MM_SLAB_MAP];
+};
+
+/* 
+ * MM_Cache
+ * Slab cache of objects of one size. It's allocated in heap with mm_malloc. Count is number of objects per slab, and partial is list of slabs with free objects. In arena mode, next links caches in header of arenas, so mm_lock_all finds their locks.
+ */
+struct MM_Cache
+{
+	size_t					size;
+	unsigned int			count;
+	struct MM_Slab *		partial;
+#if MM_ARENA
+	pthread_mutex_t			lock;
+	struct MM_Cache *		next;
+#endif
 };
 
 typedef struct MM_Node * PNODE;
 typedef struct MM_Data * PDATA;
+typedef struct MM_Slab * PSLAB;
+
+// beginning of heap, which references are relative to; set by mm_init
+static char *mm_base;
+
+// 1 if mm_free defers coalescing; set by mm_set_deferred
+static int mm_deferred = MM_DEFER;
+
+// machine words may alias any object, and source word may be unaligned
+typedef size_t __attribute__((may_alias)) MM_WORD;
+typedef size_t __attribute__((may_alias, aligned(1))) MM_UWORD;
+
+// implementaions of mm_memset, mm_memcpy and mm_memmove, selected by mm_mem_dispatch
+static void *(*mm_memset_impl)(void *, int, size_t);
+static void *(*mm_memcpy_impl)(void *, void *, size_t);
+static void *(*mm_memmove_impl)(void *, void *, size_t);
+
+#if MM_ARENA
+// arena mode can't avoid per-thread variables; binding is valid only while mm_thread_epoch equals mm_epoch
+static unsigned int mm_epoch;
+static __thread unsigned int mm_thread_epoch;
+static __thread PDATA mm_thread_arena;
+#endif
+#if MM_TCACHE
+static __thread struct MM_Tcache mm_tcache;
+static pthread_key_t mm_tcache_key;
+static pthread_once_t mm_tcache_once = PTHREAD_ONCE_INIT;
+#endif
+
+/* 
+ * mm_get_data
+ * Get data field of current arena. Without arena mode, it's at the beginning of heap.
+ */
+PDATA mm_get_data()
+{
+#if MM_ARENA
+	return mm_thread_arena;
+#else
+	return (PDATA)mm_base;
+#endif
+}
+
+/* 
+ * mm_node
+ * Get node from its reference.
+ */
+PNODE mm_node(unsigned int ref)
+{
+	return ref ? (PNODE)(mm_base + ((size_t)ref << MM_ALIGN)) : NULL;
+}
+
+/* 
+ * mm_ref
+ * Get reference of node. Node must be in heap, or NULL.
+ */
+unsigned int mm_ref(PNODE ptr)
+{
+	return ptr ? ((char *)ptr - mm_base) >> MM_ALIGN : 0;
+}
+
+/* 
+ * mm_set_link
+ * Set left child if dir is 0, right child otherwise. Returns the child.
+ */
+PNODE mm_set_link(PNODE now, int dir, PNODE ptr)
+{
+	*(dir ? &now->right : &now->left) = mm_ref(ptr);
+	return ptr;
+}
 
 /* 
  * mm_print_error
@@ -95,10 +395,10 @@ void mm_print_error(char *str)
 }
 
 /* 
- * mm_memset
- * Implementaion of memset
+ * mm_memset_byte
+ * Implementaion of memset, one byte at a time
  */
-void *mm_memset(void *b, int c, size_t len)
+void *mm_memset_byte(void *b, int c, size_t len)
 {
 	int i;
 
@@ -111,10 +411,10 @@ void *mm_memset(void *b, int c, size_t len)
 }
 
 /* 
- * mm_memcpy
- * Implementaion of memcpy
+ * mm_memcpy_byte
+ * Implementaion of memcpy, one byte at a time
  */
-void *mm_memcpy(void *dst, void *src, size_t n)
+void *mm_memcpy_byte(void *dst, void *src, size_t n)
 {
 	int i;
 	for(i = 0; i < n; i++)
@@ -126,707 +426,3685 @@ void *mm_memcpy(void *dst, void *src, size_t n)
 }
 
 /* 
- * mm_cmp_node
- * Compare between nodes. To distinguish nodes with same size, absolute pointer is compared.
+ * mm_memmove_byte
+ * Implementaion of memmove, one byte at a time; forward when moving down, backward when moving up
  */
-char mm_cmp_node(PNODE x, PNODE y)
+void *mm_memmove_byte(void *dst, void *src, size_t n)
 {
-	if(x->size == y->size)
+	size_t i;
+
+	if(dst < src)
 	{
-		return x < y;
+		for(i = 0; i < n; i++)
+		{
+			*((unsigned char *)dst + i) = *((unsigned char *)src + i);
+		}
 	}
-	return x->size < y->size;
+	else
+	{
+		for(i = n; i > 0; i--)
+		{
+			*((unsigned char *)dst + i - 1) = *((unsigned char *)src + i - 1);
+		}
+	}
+
+	return dst;
 }
 
 /* 
- * mm_rotate_left
- * Rotation function for reb-black tree implementation
+ * mm_memset_word
+ * Implementaion of memset with machine words. First and last word are stored unaligned, and words between them are aligned to destination.
  */
-PNODE mm_rotate_left(PNODE now)
+void *mm_memset_word(void *b, int c, size_t len)
 {
-	PNODE tmp;
+	unsigned char *dst = b, *end = dst + len;
+	MM_WORD word = (unsigned char)c * (~(MM_WORD)0 / 0xff);
 
-	tmp = now->right;
-	now->right = tmp->left;
-	tmp->left = now;
-	return tmp;
-}
+	if(len < sizeof(MM_WORD))
+	{
+		for(; dst < end; dst++)
+		{
+			*dst = (unsigned char)c;
+		}
+		return b;
+	}
 
-/* 
- * mm_rotate_right
- * Rotation function for reb-black tree implementation
- */
-PNODE mm_rotate_right(PNODE now)
-{
-	PNODE tmp;
+	*(MM_UWORD *)dst = word;
+	*(MM_UWORD *)(end - sizeof(MM_WORD)) = word;
+	dst = (unsigned char *)(((size_t)dst + sizeof(MM_WORD)) & ~(sizeof(MM_WORD) - 1));
+	for(; end - dst >= 4 * sizeof(MM_WORD); dst += 4 * sizeof(MM_WORD))
+	{
+		((MM_WORD *)dst)[0] = word;
+		((MM_WORD *)dst)[1] = word;
+		((MM_WORD *)dst)[2] = word;
+		((MM_WORD *)dst)[3] = word;
+	}
+	for(; end - dst >= sizeof(MM_WORD); dst += sizeof(MM_WORD))
+	{
+		*(MM_WORD *)dst = word;
+	}
 
-	tmp = now->left;
-	now->left = tmp->right;
-	tmp->right = now;
-	return tmp;
+	return b;
 }
 
 /* 
- * mm_search_node
- * Search function for reb-black tree implementation. Tries to find least segment bigger than given size. Recursively implemented.
+ * mm_memcpy_word
+ * Implementaion of memcpy with machine words. First and last word are copied unaligned, and words between them are aligned to destination. Source may stay unaligned.
  */
-PNODE mm_search_node(PNODE now, size_t size)
+void *mm_memcpy_word(void *dst, void *src, size_t n)
 {
-	PNODE ptr;
-	if(now->null == MM_NULL_NULL)
-	{
-		return NULL;
-	}
-	if(size <= now->size)
+	unsigned char *d = dst, *s = src, *end = d + n;
+	size_t head;
+
+	if(n < sizeof(MM_WORD))
 	{
-		// if there's any smaller node than this one, get it
-		ptr = mm_search_node(now->left, size);
-		if(ptr == NULL)
+		for(; d < end; d++, s++)
 		{
-			ptr = now;
+			*d = *s;
 		}
-		return ptr;
+		return dst;
 	}
-	return mm_search_node(now->right, size);
+
+	*(MM_UWORD *)d = *(MM_UWORD *)s;
+	*(MM_UWORD *)(end - sizeof(MM_WORD)) = *(MM_UWORD *)(s + n - sizeof(MM_WORD));
+	head = sizeof(MM_WORD) - ((size_t)d & (sizeof(MM_WORD) - 1));
+	d += head;
+	s += head;
+	for(; end - d >= 4 * sizeof(MM_WORD); d += 4 * sizeof(MM_WORD), s += 4 * sizeof(MM_WORD))
+	{
+		((MM_WORD *)d)[0] = ((MM_UWORD *)s)[0];
+		((MM_WORD *)d)[1] = ((MM_UWORD *)s)[1];
+		((MM_WORD *)d)[2] = ((MM_UWORD *)s)[2];
+		((MM_WORD *)d)[3] = ((MM_UWORD *)s)[3];
+	}
+	for(; end - d >= sizeof(MM_WORD); d += sizeof(MM_WORD), s += sizeof(MM_WORD))
+	{
+		*(MM_WORD *)d = *(MM_UWORD *)s;
+	}
+
+	return dst;
 }
 
 /* 
- * mm_insert_node
- * Insert function for reb-black tree implementation. Recursively implemented.
+ * mm_memmove_word
+ * Implementaion of memmove with machine words, over same aligned words as mm_memcpy_word. They're copied forward when moving down and backward when moving up, and every group of words is loaded before it's stored, so no source word is overwritten before it's read. First and last word are loaded before anything is stored and stored last.
  */
-PNODE mm_insert_node(PNODE now, PNODE new)
+void *mm_memmove_word(void *dst, void *src, size_t n)
 {
-	if(now->null == MM_NULL_NULL)
+	unsigned char *d = dst, *s = src, *end = d + n;
+	unsigned char *lo, *hi;
+	MM_WORD first, last, w0, w1, w2, w3;
+
+	if(n < sizeof(MM_WORD))
 	{
-		new->left = new->right = now;
-		new->color = MM_COLOR_RED;
-		return new;
+		return mm_memmove_byte(dst, src, n);
 	}
 
-	if(mm_cmp_node(new, now))
+	first = *(MM_UWORD *)s;
+	last = *(MM_UWORD *)(s + n - sizeof(MM_WORD));
+	lo = (unsigned char *)(((size_t)d + sizeof(MM_WORD)) & ~(sizeof(MM_WORD) - 1));
+	hi = (unsigned char *)((size_t)end & ~(sizeof(MM_WORD) - 1));
+	if(d < s)
 	{
-		now->left = mm_insert_node(now->left, new);
-
-		if(now->left->color == MM_COLOR_RED)
+		for(s += lo - d, d = lo; hi - d >= 4 * sizeof(MM_WORD); d += 4 * sizeof(MM_WORD), s += 4 * sizeof(MM_WORD))
 		{
-			if(now->left->right->color == MM_COLOR_RED)
-			{
-				now->left = mm_rotate_left(now->left);
-			}
-			if(now->left->left->color == MM_COLOR_RED)
-			{
-				if(now->right->color == MM_COLOR_RED)
-				{
-					now->left->color = now->right->color = MM_COLOR_BLACK;
-					now->color = MM_COLOR_RED;
-				}
-				else
-				{
-					now = mm_rotate_right(now);
-					now->left->color = now->right->color = MM_COLOR_RED;
-					now->color = MM_COLOR_BLACK;
-				}
-			}
+			w0 = ((MM_UWORD *)s)[0];
+			w1 = ((MM_UWORD *)s)[1];
+			w2 = ((MM_UWORD *)s)[2];
+			w3 = ((MM_UWORD *)s)[3];
+			((MM_WORD *)d)[0] = w0;
+			((MM_WORD *)d)[1] = w1;
+			((MM_WORD *)d)[2] = w2;
+			((MM_WORD *)d)[3] = w3;
+		}
+		for(; hi - d >= sizeof(MM_WORD); d += sizeof(MM_WORD), s += sizeof(MM_WORD))
+		{
+			*(MM_WORD *)d = *(MM_UWORD *)s;
 		}
 	}
 	else
 	{
-		now->right = mm_insert_node(now->right, new);
-
-		if(now->right->color == MM_COLOR_RED)
+		for(s += hi - d, d = hi; d - lo >= 4 * sizeof(MM_WORD); )
 		{
-			if(now->right->left->color == MM_COLOR_RED)
-			{
-				now->right = mm_rotate_right(now->right);
-			}
-			if(now->right->right->color == MM_COLOR_RED)
-			{
-				if(now->left->color == MM_COLOR_RED)
-				{
-					now->left->color = now->right->color = MM_COLOR_BLACK;
-					now->color = MM_COLOR_RED;
-				}
-				else
-				{
-					now = mm_rotate_left(now);
-					now->left->color = now->right->color = MM_COLOR_RED;
-					now->color = MM_COLOR_BLACK;
-				}
-			}
+			d -= 4 * sizeof(MM_WORD);
+			s -= 4 * sizeof(MM_WORD);
+			w0 = ((MM_UWORD *)s)[0];
+			w1 = ((MM_UWORD *)s)[1];
+			w2 = ((MM_UWORD *)s)[2];
+			w3 = ((MM_UWORD *)s)[3];
+			((MM_WORD *)d)[0] = w0;
+			((MM_WORD *)d)[1] = w1;
+			((MM_WORD *)d)[2] = w2;
+			((MM_WORD *)d)[3] = w3;
+		}
+		for(; d - lo >= sizeof(MM_WORD); )
+		{
+			d -= sizeof(MM_WORD);
+			s -= sizeof(MM_WORD);
+			*(MM_WORD *)d = *(MM_UWORD *)s;
 		}
 	}
+	*(MM_UWORD *)dst = first;
+	*(MM_UWORD *)(end - sizeof(MM_WORD)) = last;
 
-	return now;
+	return dst;
 }
 
+#if MM_SIMD
 /* 
- * mm_delete_left
- * Balancing of left subtree in deletion. Recursively implemented.
+ * mm_memset_sse2
+ * Implementaion of memset with 16Byte vectors, aligned like mm_memset_word. Short one is left to mm_memset_word.
  */
-PNODE mm_delete_left(PNODE now, char *balance)
+__attribute__((target("sse2")))
+void *mm_memset_sse2(void *b, int c, size_t len)
 {
-	if(now->right->color == MM_COLOR_RED)
-	{
-		now = mm_rotate_left(now);
-		now->color = MM_COLOR_BLACK;
-		now->left->color = MM_COLOR_RED;
-
-		now->left = mm_delete_left(now->left, balance);
-		return now;
-	}
+	unsigned char *dst = b, *end = dst + len;
+	__m128i vec;
 
-	if(now->color == MM_COLOR_BLACK && now->right->color == MM_COLOR_BLACK &&
-		now->right->left->color == MM_COLOR_BLACK && now->right->right->color == MM_COLOR_BLACK)
+	if(len < 32)
 	{
-		now->right->color = MM_COLOR_RED;
-		return now;
-	}
-
-	if(now->color == MM_COLOR_RED && now->right->left->color == MM_COLOR_BLACK && now->right->right->color == MM_COLOR_BLACK)
-	{
-		now->color = MM_COLOR_BLACK;
-		now->right->color = MM_COLOR_RED;
-		*balance = 1;
-		return now;
+		return mm_memset_word(b, c, len);
 	}
 
-	if(now->right->color == MM_COLOR_BLACK &&
-		now->right->left->color == MM_COLOR_RED && now->right->right->color == MM_COLOR_BLACK)
+	vec = _mm_set1_epi8((char)c);
+	_mm_storeu_si128((__m128i *)dst, vec);
+	_mm_storeu_si128((__m128i *)(end - 16), vec);
+	dst = (unsigned char *)(((size_t)dst + 16) & ~(size_t)15);
+	for(; end - dst >= 64; dst += 64)
 	{
-		now->right = mm_rotate_right(now->right);
-		now->right->color = MM_COLOR_BLACK;
-		now->right->right->color = MM_COLOR_RED;
+		_mm_store_si128((__m128i *)dst, vec);
+		_mm_store_si128((__m128i *)dst + 1, vec);
+		_mm_store_si128((__m128i *)dst + 2, vec);
+		_mm_store_si128((__m128i *)dst + 3, vec);
 	}
-
-	if(now->right->color == MM_COLOR_BLACK && now->right->right->color == MM_COLOR_RED)
+	for(; end - dst >= 16; dst += 16)
 	{
-		now = mm_rotate_left(now);
-		now->color = now->left->color;
-		now->left->color = now->right->color = MM_COLOR_BLACK;
-		*balance = 1;
-		return now;
+		_mm_store_si128((__m128i *)dst, vec);
 	}
 
-	return now;
+	return b;
 }
 
 /* 
- * mm_delete_right
- * Balancing of right subtree in deletion. Recursively implemented.
+ * mm_memcpy_sse2
+ * Implementaion of memcpy with 16Byte vectors, aligned like mm_memcpy_word. Short one is left to mm_memcpy_word.
  */
-PNODE mm_delete_right(PNODE now, char *balance)
+__attribute__((target("sse2")))
+void *mm_memcpy_sse2(void *dst, void *src, size_t n)
 {
-	if(now->left->color == MM_COLOR_RED)
-	{
-		now = mm_rotate_right(now);
-		now->color = MM_COLOR_BLACK;
-		now->right->color = MM_COLOR_RED;
-
-		now->right = mm_delete_right(now->right, balance);
-		return now;
-	}
-
-	if(now->color == MM_COLOR_BLACK && now->left->color == MM_COLOR_BLACK &&
-		now->left->left->color == MM_COLOR_BLACK && now->left->right->color == MM_COLOR_BLACK)
-	{
-		now->left->color = MM_COLOR_RED;
-		return now;
-	}
+	unsigned char *d = dst, *s = src, *end = d + n;
+	size_t head;
 
-	if(now->color == MM_COLOR_RED && now->left->left->color == MM_COLOR_BLACK && now->left->right->color == MM_COLOR_BLACK)
+	if(n < 32)
 	{
-		now->color = MM_COLOR_BLACK;
-		now->left->color = MM_COLOR_RED;
-		*balance = 1;
-		return now;
+		return mm_memcpy_word(dst, src, n);
 	}
 
-	if(now->left->color == MM_COLOR_BLACK &&
-		now->left->right->color == MM_COLOR_RED && now->left->left->color == MM_COLOR_BLACK)
+	_mm_storeu_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
+	_mm_storeu_si128((__m128i *)(end - 16), _mm_loadu_si128((__m128i *)(s + n - 16)));
+	head = 16 - ((size_t)d & 15);
+	d += head;
+	s += head;
+	for(; end - d >= 64; d += 64, s += 64)
 	{
-		now->left = mm_rotate_left(now->left);
-		now->left->color = MM_COLOR_BLACK;
-		now->left->left->color = MM_COLOR_RED;
+		__m128i v0 = _mm_loadu_si128((__m128i *)s);
+		__m128i v1 = _mm_loadu_si128((__m128i *)s + 1);
+		__m128i v2 = _mm_loadu_si128((__m128i *)s + 2);
+		__m128i v3 = _mm_loadu_si128((__m128i *)s + 3);
+		_mm_store_si128((__m128i *)d, v0);
+		_mm_store_si128((__m128i *)d + 1, v1);
+		_mm_store_si128((__m128i *)d + 2, v2);
+		_mm_store_si128((__m128i *)d + 3, v3);
 	}
-
-	if(now->left->color == MM_COLOR_BLACK && now->left->left->color == MM_COLOR_RED)
+	for(; end - d >= 16; d += 16, s += 16)
 	{
-		now = mm_rotate_right(now);
-		now->color = now->right->color;
-		now->right->color = now->left->color = MM_COLOR_BLACK;
-		*balance = 1;
-		return now;
+		_mm_store_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
 	}
 
-	return now;
+	return dst;
 }
 
 /* 
- * mm_delete_node
- * Delete function for reb-black tree implementation. Recursively implemented with mm_delete_left/right.
+ * mm_memmove_sse2
+ * Implementaion of memmove with 16Byte vectors, in order of mm_memmove_word. Short one is left to mm_memmove_word.
  */
-PNODE mm_delete_node(PNODE now, PNODE del, char *balance, PNODE *target)
+__attribute__((target("sse2")))
+void *mm_memmove_sse2(void *dst, void *src, size_t n)
 {
-	PNODE ptr;
+	unsigned char *d = dst, *s = src, *end = d + n;
+	unsigned char *lo, *hi;
+	__m128i first, last, v0, v1, v2, v3;
 
-	if(target)
+	if(n < 32)
 	{
-		if(now->left->null == MM_NULL_NULL)
-		{
-			*target = now;
-			*balance = (now->color == MM_COLOR_RED) || (now->right->color == MM_COLOR_RED);
-			now = now->right;
-			now->color = MM_COLOR_BLACK;
-		}
-		else
-		{
-			now->left = mm_delete_node(now->left, del, balance, target);
-			if(!*balance)
-			{
-				now = mm_delete_left(now, balance);
-			}
-		}
-		return now;
+		return mm_memmove_word(dst, src, n);
 	}
-	if(now == del)
+
+	first = _mm_loadu_si128((__m128i *)s);
+	last = _mm_loadu_si128((__m128i *)(s + n - 16));
+	lo = (unsigned char *)(((size_t)d + 16) & ~(size_t)15);
+	hi = (unsigned char *)((size_t)end & ~(size_t)15);
+	if(d < s)
 	{
-		if(now->right->null == MM_NULL_NULL)
+		for(s += lo - d, d = lo; hi - d >= 64; d += 64, s += 64)
 		{
-			*balance = (now->color == MM_COLOR_RED) || (now->left->color == MM_COLOR_RED);
-			now = now->left;
-			now->color = MM_COLOR_BLACK;
+			v0 = _mm_loadu_si128((__m128i *)s);
+			v1 = _mm_loadu_si128((__m128i *)s + 1);
+			v2 = _mm_loadu_si128((__m128i *)s + 2);
+			v3 = _mm_loadu_si128((__m128i *)s + 3);
+			_mm_store_si128((__m128i *)d, v0);
+			_mm_store_si128((__m128i *)d + 1, v1);
+			_mm_store_si128((__m128i *)d + 2, v2);
+			_mm_store_si128((__m128i *)d + 3, v3);
 		}
-		else
+		for(; hi - d >= 16; d += 16, s += 16)
 		{
-			now->right = mm_delete_node(now->right, del, balance, &ptr);
-			ptr->color = now->color;
-			ptr->left = now->left;
-			ptr->right = now->right;
-			ptr->color = now->color;
-			now = ptr;
-			if(!*balance)
-			{
-				now = mm_delete_right(now, balance);
-			}
+			_mm_store_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
 		}
 	}
-	else if(mm_cmp_node(del, now))
+	else
 	{
-		now->left = mm_delete_node(now->left, del, balance, NULL);
-		if(!*balance)
+		for(s += hi - d, d = hi; d - lo >= 64; )
 		{
-			return mm_delete_left(now, balance);
+			d -= 64;
+			s -= 64;
+			v0 = _mm_loadu_si128((__m128i *)s);
+			v1 = _mm_loadu_si128((__m128i *)s + 1);
+			v2 = _mm_loadu_si128((__m128i *)s + 2);
+			v3 = _mm_loadu_si128((__m128i *)s + 3);
+			_mm_store_si128((__m128i *)d, v0);
+			_mm_store_si128((__m128i *)d + 1, v1);
+			_mm_store_si128((__m128i *)d + 2, v2);
+			_mm_store_si128((__m128i *)d + 3, v3);
+		}
+		for(; d - lo >= 16; )
+		{
+			d -= 16;
+			s -= 16;
+			_mm_store_si128((__m128i *)d, _mm_loadu_si128((__m128i *)s));
 		}
 	}
-	else
+	_mm_storeu_si128((__m128i *)dst, first);
+	_mm_storeu_si128((__m128i *)(end - 16), last);
+
+	return dst;
+}
+
+/* 
+ * mm_memset_avx2
+ * Implementaion of memset with 32Byte vectors, aligned like mm_memset_word. Short one is left to mm_memset_sse2.
+ */
+__attribute__((target("avx2")))
+void *mm_memset_avx2(void *b, int c, size_t len)
+{
+	unsigned char *dst = b, *end = dst + len;
+	__m256i vec;
+
+	if(len < 64)
+	{
+		return mm_memset_sse2(b, c, len);
+	}
+
+	vec = _mm256_set1_epi8((char)c);
+	_mm256_storeu_si256((__m256i *)dst, vec);
+	_mm256_storeu_si256((__m256i *)(end - 32), vec);
+	dst = (unsigned char *)(((size_t)dst + 32) & ~(size_t)31);
+	for(; end - dst >= 128; dst += 128)
+	{
+		_mm256_store_si256((__m256i *)dst, vec);
+		_mm256_store_si256((__m256i *)dst + 1, vec);
+		_mm256_store_si256((__m256i *)dst + 2, vec);
+		_mm256_store_si256((__m256i *)dst + 3, vec);
+	}
+	for(; end - dst >= 32; dst += 32)
+	{
+		_mm256_store_si256((__m256i *)dst, vec);
+	}
+
+	return b;
+}
+
+/* 
+ * mm_memcpy_avx2
+ * Implementaion of memcpy with 32Byte vectors, aligned like mm_memcpy_word. Short one is left to mm_memcpy_sse2.
+ */
+__attribute__((target("avx2")))
+void *mm_memcpy_avx2(void *dst, void *src, size_t n)
+{
+	unsigned char *d = dst, *s = src, *end = d + n;
+	size_t head;
+
+	if(n < 64)
+	{
+		return mm_memcpy_sse2(dst, src, n);
+	}
+
+	_mm256_storeu_si256((__m256i *)d, _mm256_loadu_si256((__m256i *)s));
+	_mm256_storeu_si256((__m256i *)(end - 32), _mm256_loadu_si256((__m256i *)(s + n - 32)));
+	head = 32 - ((size_t)d & 31);
+	d += head;
+	s += head;
+	for(; end - d >= 128; d += 128, s += 128)
+	{
+		__m256i v0 = _mm256_loadu_si256((__m256i *)s);
+		__m256i v1 = _mm256_loadu_si256((__m256i *)s + 1);
+		__m256i v2 = _mm256_loadu_si256((__m256i *)s + 2);
+		__m256i v3 = _mm256_loadu_si256((__m256i *)s + 3);
+		_mm256_store_si256((__m256i *)d, v0);
+		_mm256_store_si256((__m256i *)d + 1, v1);
+		_mm256_store_si256((__m256i *)d + 2, v2);
+		_mm256_store_si256((__m256i *)d + 3, v3);
+	}
+	for(; end - d >= 32; d += 32, s += 32)
+	{
+		_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((__m256i *)s));
+	}
+
+	return dst;
+}
+/* 
+ * mm_memmove_avx2
+ * Implementaion of memmove with 32Byte vectors, in order of mm_memmove_word. Short one is left to mm_memmove_sse2.
+ */
+__attribute__((target("avx2")))
+void *mm_memmove_avx2(void *dst, void *src, size_t n)
+{
+	unsigned char *d = dst, *s = src, *end = d + n;
+	unsigned char *lo, *hi;
+	__m256i first, last, v0, v1, v2, v3;
+
+	if(n < 64)
+	{
+		return mm_memmove_sse2(dst, src, n);
+	}
+
+	first = _mm256_loadu_si256((__m256i *)s);
+	last = _mm256_loadu_si256((__m256i *)(s + n - 32));
+	lo = (unsigned char *)(((size_t)d + 32) & ~(size_t)31);
+	hi = (unsigned char *)((size_t)end & ~(size_t)31);
+	if(d < s)
+	{
+		for(s += lo - d, d = lo; hi - d >= 128; d += 128, s += 128)
+		{
+			v0 = _mm256_loadu_si256((__m256i *)s);
+			v1 = _mm256_loadu_si256((__m256i *)s + 1);
+			v2 = _mm256_loadu_si256((__m256i *)s + 2);
+			v3 = _mm256_loadu_si256((__m256i *)s + 3);
+			_mm256_store_si256((__m256i *)d, v0);
+			_mm256_store_si256((__m256i *)d + 1, v1);
+			_mm256_store_si256((__m256i *)d + 2, v2);
+			_mm256_store_si256((__m256i *)d + 3, v3);
+		}
+		for(; hi - d >= 32; d += 32, s += 32)
+		{
+			_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((__m256i *)s));
+		}
+	}
+	else
+	{
+		for(s += hi - d, d = hi; d - lo >= 128; )
+		{
+			d -= 128;
+			s -= 128;
+			v0 = _mm256_loadu_si256((__m256i *)s);
+			v1 = _mm256_loadu_si256((__m256i *)s + 1);
+			v2 = _mm256_loadu_si256((__m256i *)s + 2);
+			v3 = _mm256_loadu_si256((__m256i *)s + 3);
+			_mm256_store_si256((__m256i *)d, v0);
+			_mm256_store_si256((__m256i *)d + 1, v1);
+			_mm256_store_si256((__m256i *)d + 2, v2);
+			_mm256_store_si256((__m256i *)d + 3, v3);
+		}
+		for(; d - lo >= 32; )
+		{
+			d -= 32;
+			s -= 32;
+			_mm256_store_si256((__m256i *)d, _mm256_loadu_si256((__m256i *)s));
+		}
+	}
+	_mm256_storeu_si256((__m256i *)dst, first);
+	_mm256_storeu_si256((__m256i *)(end - 32), last);
+
+	return dst;
+}
+#endif
+
+/* 
+ * mm_mem_dispatch
+ * Select widest implementaion of memset, memcpy and memmove supported by running CPU. Called once by first mm_memset, mm_memcpy or mm_memmove.
+ */
+void mm_mem_dispatch(void)
+{
+	void *(*memset_impl)(void *, int, size_t) = mm_memset_word;
+	void *(*memcpy_impl)(void *, void *, size_t) = mm_memcpy_word;
+	void *(*memmove_impl)(void *, void *, size_t) = mm_memmove_word;
+
+#if MM_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		memset_impl = mm_memset_avx2;
+		memcpy_impl = mm_memcpy_avx2;
+		memmove_impl = mm_memmove_avx2;
+	}
+	else if(__builtin_cpu_supports("sse2"))
+	{
+		memset_impl = mm_memset_sse2;
+		memcpy_impl = mm_memcpy_sse2;
+		memmove_impl = mm_memmove_sse2;
+	}
+#endif
+
+	// racing threads store same pointers
+	mm_memset_impl = memset_impl;
+	mm_memcpy_impl = memcpy_impl;
+	mm_memmove_impl = memmove_impl;
+}
+
+/* 
+ * mm_memset
+ * Implementaion of memset, dispatched to mm_memset_avx2, mm_memset_sse2 or mm_memset_word
+ */
+void *mm_memset(void *b, int c, size_t len)
+{
+	if(!mm_memset_impl)
+	{
+		mm_mem_dispatch();
+	}
+	return mm_memset_impl(b, c, len);
+}
+
+/* 
+ * mm_memcpy
+ * Implementaion of memcpy, dispatched to mm_memcpy_avx2, mm_memcpy_sse2 or mm_memcpy_word
+ */
+void *mm_memcpy(void *dst, void *src, size_t n)
+{
+	if(!mm_memcpy_impl)
+	{
+		mm_mem_dispatch();
+	}
+	return mm_memcpy_impl(dst, src, n);
+}
+
+/* 
+ * mm_memmove
+ * Implementaion of memmove, dispatched to mm_memmove_avx2, mm_memmove_sse2 or mm_memmove_word
+ */
+void *mm_memmove(void *dst, void *src, size_t n)
+{
+	if(!mm_memmove_impl)
+	{
+		mm_mem_dispatch();
+	}
+	return mm_memmove_impl(dst, src, n);
+}
+
+/* 
+ * mm_cmp_node
+ * Compare between nodes. To distinguish nodes with same size, absolute pointer is compared.
+ */
+char mm_cmp_node(PNODE x, PNODE y)
+{
+	if(x->size == y->size)
+	{
+		return x < y;
+	}
+	return x->size < y->size;
+}
+
+/* 
+ * mm_rotate_left
+ * Rotation function for reb-black tree implementation
+ */
+PNODE mm_rotate_left(PNODE now)
+{
+	PNODE tmp;
+
+	tmp = MM_RIGHT(now);
+	now->right = tmp->left;
+	tmp->left = mm_ref(now);
+	return tmp;
+}
+
+/* 
+ * mm_rotate_right
+ * Rotation function for reb-black tree implementation
+ */
+PNODE mm_rotate_right(PNODE now)
+{
+	PNODE tmp;
+
+	tmp = MM_LEFT(now);
+	now->left = tmp->right;
+	tmp->right = mm_ref(now);
+	return tmp;
+}
+
+/* 
+ * mm_search_node
+ * Search function for reb-black tree implementation. Tries to find least segment bigger than given size. Recursively implemented.
+ */
+PNODE mm_search_node(PNODE now, size_t size)
+{
+	PNODE ptr;
+	if(now->null == MM_NULL_NULL)
+	{
+		return NULL;
+	}
+	if(size <= now->size)
+	{
+		// if there's any smaller node than this one, get it
+		ptr = mm_search_node(MM_LEFT(now), size);
+		if(ptr == NULL)
+		{
+			ptr = now;
+		}
+		return ptr;
+	}
+	return mm_search_node(MM_RIGHT(now), size);
+}
+
+/* 
+ * mm_insert_node
+ * Insert function for reb-black tree implementation. Recursively implemented.
+ */
+PNODE mm_insert_node(PNODE now, PNODE new)
+{
+	if(now->null == MM_NULL_NULL)
+	{
+		new->left = new->right = mm_ref(now);
+		new->color = MM_COLOR_RED;
+		return new;
+	}
+
+	if(mm_cmp_node(new, now))
+	{
+		now->left = mm_ref(mm_insert_node(MM_LEFT(now), new));
+
+		if(MM_LEFT(now)->color == MM_COLOR_RED)
+		{
+			if(MM_RIGHT(MM_LEFT(now))->color == MM_COLOR_RED)
+			{
+				now->left = mm_ref(mm_rotate_left(MM_LEFT(now)));
+			}
+			if(MM_LEFT(MM_LEFT(now))->color == MM_COLOR_RED)
+			{
+				if(MM_RIGHT(now)->color == MM_COLOR_RED)
+				{
+					MM_LEFT(now)->color = MM_RIGHT(now)->color = MM_COLOR_BLACK;
+					now->color = MM_COLOR_RED;
+				}
+				else
+				{
+					now = mm_rotate_right(now);
+					MM_LEFT(now)->color = MM_RIGHT(now)->color = MM_COLOR_RED;
+					now->color = MM_COLOR_BLACK;
+				}
+			}
+		}
+	}
+	else
+	{
+		now->right = mm_ref(mm_insert_node(MM_RIGHT(now), new));
+
+		if(MM_RIGHT(now)->color == MM_COLOR_RED)
+		{
+			if(MM_LEFT(MM_RIGHT(now))->color == MM_COLOR_RED)
+			{
+				now->right = mm_ref(mm_rotate_right(MM_RIGHT(now)));
+			}
+			if(MM_RIGHT(MM_RIGHT(now))->color == MM_COLOR_RED)
+			{
+				if(MM_LEFT(now)->color == MM_COLOR_RED)
+				{
+					MM_LEFT(now)->color = MM_RIGHT(now)->color = MM_COLOR_BLACK;
+					now->color = MM_COLOR_RED;
+				}
+				else
+				{
+					now = mm_rotate_left(now);
+					MM_LEFT(now)->color = MM_RIGHT(now)->color = MM_COLOR_RED;
+					now->color = MM_COLOR_BLACK;
+				}
+			}
+		}
+	}
+
+	return now;
+}
+
+/* 
+ * mm_delete_left
+ * Balancing of left subtree in deletion. Recursively implemented.
+ */
+PNODE mm_delete_left(PNODE now, char *balance)
+{
+	if(MM_RIGHT(now)->color == MM_COLOR_RED)
+	{
+		now = mm_rotate_left(now);
+		now->color = MM_COLOR_BLACK;
+		MM_LEFT(now)->color = MM_COLOR_RED;
+
+		now->left = mm_ref(mm_delete_left(MM_LEFT(now), balance));
+		return now;
+	}
+
+	if(now->color == MM_COLOR_BLACK && MM_RIGHT(now)->color == MM_COLOR_BLACK &&
+		MM_LEFT(MM_RIGHT(now))->color == MM_COLOR_BLACK && MM_RIGHT(MM_RIGHT(now))->color == MM_COLOR_BLACK)
+	{
+		MM_RIGHT(now)->color = MM_COLOR_RED;
+		return now;
+	}
+
+	if(now->color == MM_COLOR_RED && MM_LEFT(MM_RIGHT(now))->color == MM_COLOR_BLACK && MM_RIGHT(MM_RIGHT(now))->color == MM_COLOR_BLACK)
+	{
+		now->color = MM_COLOR_BLACK;
+		MM_RIGHT(now)->color = MM_COLOR_RED;
+		*balance = 1;
+		return now;
+	}
+
+	if(MM_RIGHT(now)->color == MM_COLOR_BLACK &&
+		MM_LEFT(MM_RIGHT(now))->color == MM_COLOR_RED && MM_RIGHT(MM_RIGHT(now))->color == MM_COLOR_BLACK)
+	{
+		now->right = mm_ref(mm_rotate_right(MM_RIGHT(now)));
+		MM_RIGHT(now)->color = MM_COLOR_BLACK;
+		MM_RIGHT(MM_RIGHT(now))->color = MM_COLOR_RED;
+	}
+
+	if(MM_RIGHT(now)->color == MM_COLOR_BLACK && MM_RIGHT(MM_RIGHT(now))->color == MM_COLOR_RED)
+	{
+		now = mm_rotate_left(now);
+		now->color = MM_LEFT(now)->color;
+		MM_LEFT(now)->color = MM_RIGHT(now)->color = MM_COLOR_BLACK;
+		*balance = 1;
+		return now;
+	}
+
+	return now;
+}
+
+/* 
+ * mm_delete_right
+ * Balancing of right subtree in deletion. Recursively implemented.
+ */
+PNODE mm_delete_right(PNODE now, char *balance)
+{
+	if(MM_LEFT(now)->color == MM_COLOR_RED)
+	{
+		now = mm_rotate_right(now);
+		now->color = MM_COLOR_BLACK;
+		MM_RIGHT(now)->color = MM_COLOR_RED;
+
+		now->right = mm_ref(mm_delete_right(MM_RIGHT(now), balance));
+		return now;
+	}
+
+	if(now->color == MM_COLOR_BLACK && MM_LEFT(now)->color == MM_COLOR_BLACK &&
+		MM_LEFT(MM_LEFT(now))->color == MM_COLOR_BLACK && MM_RIGHT(MM_LEFT(now))->color == MM_COLOR_BLACK)
+	{
+		MM_LEFT(now)->color = MM_COLOR_RED;
+		return now;
+	}
+
+	if(now->color == MM_COLOR_RED && MM_LEFT(MM_LEFT(now))->color == MM_COLOR_BLACK && MM_RIGHT(MM_LEFT(now))->color == MM_COLOR_BLACK)
+	{
+		now->color = MM_COLOR_BLACK;
+		MM_LEFT(now)->color = MM_COLOR_RED;
+		*balance = 1;
+		return now;
+	}
+
+	if(MM_LEFT(now)->color == MM_COLOR_BLACK &&
+		MM_RIGHT(MM_LEFT(now))->color == MM_COLOR_RED && MM_LEFT(MM_LEFT(now))->color == MM_COLOR_BLACK)
+	{
+		now->left = mm_ref(mm_rotate_left(MM_LEFT(now)));
+		MM_LEFT(now)->color = MM_COLOR_BLACK;
+		MM_LEFT(MM_LEFT(now))->color = MM_COLOR_RED;
+	}
+
+	if(MM_LEFT(now)->color == MM_COLOR_BLACK && MM_LEFT(MM_LEFT(now))->color == MM_COLOR_RED)
+	{
+		now = mm_rotate_right(now);
+		now->color = MM_RIGHT(now)->color;
+		MM_RIGHT(now)->color = MM_LEFT(now)->color = MM_COLOR_BLACK;
+		*balance = 1;
+		return now;
+	}
+
+	return now;
+}
+
+/* 
+ * mm_delete_node
+ * Delete function for reb-black tree implementation. Recursively implemented with mm_delete_left/right.
+ */
+PNODE mm_delete_node(PNODE now, PNODE del, char *balance, PNODE *target)
+{
+	PNODE ptr;
+
+	if(target)
+	{
+		if(MM_LEFT(now)->null == MM_NULL_NULL)
+		{
+			*target = now;
+			*balance = (now->color == MM_COLOR_RED) || (MM_RIGHT(now)->color == MM_COLOR_RED);
+			now = MM_RIGHT(now);
+			now->color = MM_COLOR_BLACK;
+		}
+		else
+		{
+			now->left = mm_ref(mm_delete_node(MM_LEFT(now), del, balance, target));
+			if(!*balance)
+			{
+				now = mm_delete_left(now, balance);
+			}
+		}
+		return now;
+	}
+	if(now == del)
+	{
+		if(MM_RIGHT(now)->null == MM_NULL_NULL)
+		{
+			*balance = (now->color == MM_COLOR_RED) || (MM_LEFT(now)->color == MM_COLOR_RED);
+			now = MM_LEFT(now);
+			now->color = MM_COLOR_BLACK;
+		}
+		else
+		{
+			now->right = mm_ref(mm_delete_node(MM_RIGHT(now), del, balance, &ptr));
+			ptr->color = now->color;
+			ptr->left = now->left;
+			ptr->right = now->right;
+			ptr->color = now->color;
+			now = ptr;
+			if(!*balance)
+			{
+				now = mm_delete_right(now, balance);
+			}
+		}
+	}
+	else if(mm_cmp_node(del, now))
+	{
+		now->left = mm_ref(mm_delete_node(MM_LEFT(now), del, balance, NULL));
+		if(!*balance)
+		{
+			return mm_delete_left(now, balance);
+		}
+	}
+	else
+	{
+		now->right = mm_ref(mm_delete_node(MM_RIGHT(now), del, balance, NULL));
+		if(!*balance)
+		{
+			return mm_delete_right(now, balance);
+		}
+	}
+	return now;
+}
+
+/* 
+ * mm_search_iter
+ * Iterative version of mm_search_node.
+ */
+PNODE mm_search_iter(PNODE now, size_t size)
+{
+	PNODE ptr;
+
+	ptr = NULL;
+	while(now->null == MM_NULL_NOTNULL)
+	{
+		if(size <= now->size)
+		{
+			// candidate; try to find smaller one in left subtree
+			ptr = now;
+			now = MM_LEFT(now);
+		}
+		else
+		{
+			now = MM_RIGHT(now);
+		}
+	}
+	return ptr;
+}
+
+/* 
+ * mm_single
+ * Rotation function for top-down red-black tree implementation. Rotates toward dir and recolors.
+ */
+PNODE mm_single(PNODE now, int dir)
+{
+	PNODE tmp;
+
+	tmp = dir ? mm_rotate_right(now) : mm_rotate_left(now);
+	now->color = MM_COLOR_RED;
+	tmp->color = MM_COLOR_BLACK;
+	return tmp;
+}
+
+/* 
+ * mm_double
+ * Double rotation function for top-down red-black tree implementation.
+ */
+PNODE mm_double(PNODE now, int dir)
+{
+	mm_set_link(now, !dir, mm_single(MM_LINK(now, !dir), !dir));
+	return mm_single(now, dir);
+}
+
+/* 
+ * mm_insert_iter
+ * Insert function for red-black tree implementation. Single top-down pass; red nodes are split on the way down with color flips, so no parent pointer or stack is required.
+ */
+PNODE mm_insert_iter(PNODE root, PNODE new)
+{
+	int dir, last;
+	struct MM_Node head;
+	PNODE t, g, p, q;
+
+	// empty tree
+	if(root->null == MM_NULL_NULL)
+	{
+		new->left = new->right = mm_ref(root);
+		new->color = MM_COLOR_RED;
+		return new;
+	}
+
+	// false root
+	head.color = MM_COLOR_BLACK;
+	head.right = mm_ref(root);
+
+	dir = last = 0;
+	t = &head;
+	g = p = NULL;
+	q = root;
+
+	while(1)
+	{
+		if(q->null == MM_NULL_NULL)
+		{
+			// insert new node at the bottom
+			new->left = new->right = mm_ref(q);
+			new->color = MM_COLOR_RED;
+			q = mm_set_link(p, dir, new);
+		}
+		else if(MM_IS_RED(MM_LEFT(q)) && MM_IS_RED(MM_RIGHT(q)))
+		{
+			// color flip
+			q->color = MM_COLOR_RED;
+			MM_LEFT(q)->color = MM_RIGHT(q)->color = MM_COLOR_BLACK;
+		}
+
+		// fix red violation
+		if(p != NULL && MM_IS_RED(q) && MM_IS_RED(p))
+		{
+			if(q == MM_LINK(p, last))
+			{
+				mm_set_link(t, MM_RIGHT(t) == g, mm_single(g, !last));
+			}
+			else
+			{
+				mm_set_link(t, MM_RIGHT(t) == g, mm_double(g, !last));
+			}
+		}
+
+		if(q == new)
+		{
+			break;
+		}
+
+		last = dir;
+		dir = mm_cmp_node(q, new);
+
+		if(g != NULL)
+		{
+			t = g;
+		}
+		g = p;
+		p = q;
+		q = MM_LINK(q, dir);
+	}
+
+	return MM_RIGHT(&head);
+}
+
+/* 
+ * mm_delete_iter
+ * Delete function for red-black tree implementation. Single top-down pass pushing a red node down to the bottom. Since segments can't be copied, in-order predecessor is spliced into position of deleted node instead of copying data.
+ */
+PNODE mm_delete_iter(PNODE root, PNODE del, PNODE null)
+{
+	int dir, last;
+	struct MM_Node head;
+	PNODE g, p, q, s, f, fp;
+
+	// false root
+	head.color = MM_COLOR_BLACK;
+	head.left = mm_ref(null);
+	head.right = mm_ref(root);
+
+	dir = 1;
+	q = &head;
+	g = p = f = fp = NULL;
+
+	while(MM_LINK(q, dir)->null == MM_NULL_NOTNULL)
+	{
+		last = dir;
+
+		g = p;
+		p = q;
+		q = MM_LINK(q, dir);
+		dir = mm_cmp_node(q, del);
+
+		// save found node and its parent
+		if(q == del)
+		{
+			f = q;
+			fp = p;
+		}
+
+		// push red node down
+		if(!MM_IS_RED(q) && !MM_IS_RED(MM_LINK(q, dir)))
+		{
+			if(MM_IS_RED(MM_LINK(q, !dir)))
+			{
+				p = mm_set_link(p, last, mm_single(q, dir));
+				if(q == f)
+				{
+					fp = p;
+				}
+			}
+			else if((s = MM_LINK(p, !last))->null == MM_NULL_NOTNULL)
+			{
+				if(!MM_IS_RED(MM_LEFT(s)) && !MM_IS_RED(MM_RIGHT(s)))
+				{
+					// color flip
+					p->color = MM_COLOR_BLACK;
+					s->color = q->color = MM_COLOR_RED;
+				}
+				else
+				{
+					if(MM_IS_RED(MM_LINK(s, last)))
+					{
+						s = mm_set_link(g, MM_RIGHT(g) == p, mm_double(p, last));
+					}
+					else
+					{
+						s = mm_set_link(g, MM_RIGHT(g) == p, mm_single(p, last));
+					}
+					if(p == f)
+					{
+						fp = s;
+					}
+
+					// ensure correct coloring
+					q->color = s->color = MM_COLOR_RED;
+					MM_LEFT(s)->color = MM_RIGHT(s)->color = MM_COLOR_BLACK;
+				}
+			}
+		}
+	}
+
+	// remove q from tree
+	mm_set_link(p, MM_RIGHT(p) == q, MM_LINK(q, MM_LEFT(q)->null == MM_NULL_NULL));
+
+	// put q into position of deleted node
+	if(f != q)
+	{
+		q->left = f->left;
+		q->right = f->right;
+		q->color = f->color;
+		mm_set_link(fp, MM_RIGHT(fp) == f, q);
+	}
+
+	return MM_RIGHT(&head);
+}
+
+/* 
+ * mm_tree_search
+ * Search in red-black tree of given root with recursive or iterative implementation.
+ */
+PNODE mm_tree_search(PNODE root, size_t size)
+{
+#if MM_RBTREE_ITERATIVE
+	return mm_search_iter(root, size);
+#else
+	return mm_search_node(root, size);
+#endif
+}
+
+/* 
+ * mm_tree_insert
+ * Insert into red-black tree of given root with recursive or iterative implementation. Returns new root.
+ */
+PNODE mm_tree_insert(PNODE root, PNODE new)
+{
+#if MM_RBTREE_ITERATIVE
+	root = mm_insert_iter(root, new);
+#else
+	root = mm_insert_node(root, new);
+#endif
+	// set root black in case of rotation on root node
+	root->color = MM_COLOR_BLACK;
+	return root;
+}
+
+/* 
+ * mm_tree_delete
+ * Delete from red-black tree of given root with recursive or iterative implementation. Returns new root.
+ */
+PNODE mm_tree_delete(PNODE root, PNODE del)
+{
+#if !MM_RBTREE_ITERATIVE
+	char balance;
+#endif
+
+	// delete node; del should exists in tree
+#if MM_RBTREE_ITERATIVE
+	root = mm_delete_iter(root, del, &mm_get_data()->null);
+#else
+	root = mm_delete_node(root, del, &balance, NULL);
+#endif
+	// set root black in case of rotation on root node
+	root->color = MM_COLOR_BLACK;
+	return root;
+}
+
+#if MM_BITMAP
+/* 
+ * mm_bin_index
+ * Get bin of segment size. Sizes below MM_SL_COUNT have their own bins; others are split by highest bit into first level, and by following MM_SL_SHIFT bits into second level. Sizes beyond last first level share the last bin.
+ */
+void mm_bin_index(size_t size, unsigned int *fl, unsigned int *sl)
+{
+	unsigned int msb;
+
+	if(size < MM_SL_COUNT)
+	{
+		*fl = 0;
+		*sl = size;
+		return;
+	}
+	msb = 31 - __builtin_clz((unsigned int)size);
+	*fl = msb - MM_SL_SHIFT + 1;
+	*sl = (size >> (msb - MM_SL_SHIFT)) - MM_SL_COUNT;
+	if(*fl >= MM_FL_COUNT)
+	{
+		*fl = MM_FL_COUNT - 1;
+		*sl = MM_SL_COUNT - 1;
+	}
+}
+
+/* 
+ * mm_first_node
+ * Get least node of red-black tree.
+ */
+PNODE mm_first_node(PNODE now)
+{
+	PNODE left;
+
+	while((left = MM_LEFT(now))->null == MM_NULL_NOTNULL)
+	{
+		now = left;
+	}
+	return now;
+}
+#endif
+
+/* 
+ * mm_search
+ * Search wrapper function. With bitmap, only bin of size is searched in red-black tree; if it has nothing fits, least segment of next non-empty bin found by bit scans is the best fit.
+ */
+PNODE mm_search(size_t size)
+{
+	PDATA data;
+#if MM_BITMAP
+	unsigned int fl, sl, map;
+	PNODE ptr;
+#endif
+
+	// get data field
+	data = mm_get_data();
+#if MM_BITMAP
+	mm_bin_index(size, &fl, &sl);
+	// search least node bigger than size in its bin
+	if(data->sl_map[fl] & (1U << sl))
+	{
+		ptr = mm_tree_search(mm_node(data->bin[fl][sl]), size);
+		if(ptr != NULL)
+		{
+			return ptr;
+		}
+	}
+
+	// every segment in following bins is bigger than size
+	map = data->sl_map[fl] & (~1U << sl);
+	if(map == 0)
+	{
+		map = data->fl_map & (~1U << fl);
+		if(map == 0)
+		{
+			return NULL;
+		}
+		fl = __builtin_ctz(map);
+		map = data->sl_map[fl];
+	}
+	sl = __builtin_ctz(map);
+	return mm_first_node(mm_node(data->bin[fl][sl]));
+#else
+	//search least node bigger than size
+	return mm_tree_search(data->root, size);
+#endif
+}
+
+/* 
+ * mm_insert
+ * Insert wrapper function
+ */
+void mm_insert(PNODE new)
+{
+	PDATA data;
+#if MM_BITMAP
+	unsigned int fl, sl;
+#endif
+
+	// get data field
+	data = mm_get_data();
+	data->free_bytes += (size_t)new->size << MM_ALIGN;
+	// insert node into red-black tree
+#if MM_BITMAP
+	mm_bin_index(new->size, &fl, &sl);
+	data->bin[fl][sl] = mm_ref(mm_tree_insert(mm_node(data->bin[fl][sl]), new));
+	data->sl_map[fl] |= 1U << sl;
+	data->fl_map |= 1U << fl;
+#else
+	data->root = mm_tree_insert(data->root, new);
+#endif
+}
+
+/* 
+ * mm_delete
+ * Delete wrapper function
+ */
+void mm_delete(PNODE del)
+{
+	PDATA data;
+#if MM_BITMAP
+	unsigned int fl, sl;
+	PNODE root;
+#endif
+
+	// get data field
+	data = mm_get_data();
+	data->free_bytes -= (size_t)del->size << MM_ALIGN;
+	// delete node; del should exists in tree
+#if MM_BITMAP
+	mm_bin_index(del->size, &fl, &sl);
+	root = mm_tree_delete(mm_node(data->bin[fl][sl]), del);
+	data->bin[fl][sl] = mm_ref(root);
+	// clear bits of empty bin
+	if(root->null == MM_NULL_NULL)
+	{
+		data->sl_map[fl] &= ~(1U << sl);
+		if(data->sl_map[fl] == 0)
+		{
+			data->fl_map &= ~(1U << fl);
+		}
+	}
+#else
+	data->root = mm_tree_delete(data->root, del);
+#endif
+}
+
+/* 
+ * mm_get_prev
+ * Get previous segment using previous segment's footer.
+ */
+PNODE mm_get_prev(PNODE ptr)
+{
+	// actually it's footer of previous segment
+	return MM_PREV(ptr);
+}
+
+/* 
+ * mm_get_next
+ * Get next segment using current segment's size field.
+ */
+PNODE mm_get_next(PNODE ptr)
+{
+	// calculate next segment with size
+	return (PNODE)(((void *)ptr) + ((size_t)ptr->size << MM_ALIGN));
+}
+
+/* 
+ * mm_clear_header
+ * Clear header of segment. Only clears linked-list header, not red-black tree node information.
+ */
+void mm_clear_header(void *ptr)
+{
+	// by constant definition, set all bits 0 works
+	mm_memset(ptr, 0, MM_HEADER_SIZE);
+}
+
+/* 
+ * mm_frag_node
+ * Break free segment into two segments. First one is for allocation, second one is inserted into red-black tree.
+ */
+void *mm_frag_node(PNODE now, size_t size)
+{
+	size_t tsize;
+	PNODE next;
+
+	// if given segment is too small to fragment, just return
+	if(now->size < size + (MM_NODE_SIZE >> MM_ALIGN))
+	{
+		mm_get_next(now)->prev = mm_ref(now);
+		return now;
+	}
+
+	tsize = now->size - size;
+	now->size = size;
+
+	// set second segment's header
+	next = mm_get_next(now);
+	mm_clear_header(next);
+	next->size = tsize;
+
+	// set list pointers
+	next->prev = mm_ref(now);
+	mm_get_next(next)->prev = mm_ref(next);
+	
+	// insert second node into red-black tree
+	next->alloc = MM_ALLOC_FREE;
+	mm_insert(next);
+
+	// re-allocation doesn't occur
+	return now;
+}
+
+/* 
+ * mm_heap_full
+ * Returns 1 if heap can't grow by size since references can't address beyond MM_HEAP_MAX.
+ */
+int mm_heap_full(size_t size)
+{
+	return (unsigned long long)mem_heapsize() + size > MM_HEAP_MAX;
+}
+
+/* 
+ * mm_chunk_size
+ * Get size heap grows by when list needs size more than it has reserved. With MM_CHUNK, chunk doubles while utilization of list is high, where at most 1/2^MM_CHUNK_UTIL of it is free, up to 1/2^MM_CHUNK_SHIFT of list and MM_CHUNK_MAX; list with more free bytes collapses it to MM_UNIT, since its growth is fragmentation rather than burst of live data.
+ */
+size_t mm_chunk_size(size_t size)
+{
+#if MM_CHUNK
+	size_t limit;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	limit = data->heap_bytes >> MM_CHUNK_SHIFT;
+	limit = limit < MM_CHUNK_MAX ? limit : MM_CHUNK_MAX;
+	if(data->free_bytes <= data->heap_bytes >> MM_CHUNK_UTIL && data->chunk * 2 <= limit)
+	{
+		data->chunk *= 2;
+	}
+	else if(data->free_bytes > data->heap_bytes >> MM_CHUNK_UTIL)
+	{
+		data->chunk = MM_UNIT;
+	}
+	return size < data->chunk ? data->chunk : size;
+#else
+	return size;
+#endif
+}
+
+/* 
+ * mm_heap_grow
+ * Extends heap reserved for list of current arena by chunk of given size, or by least size if heap can't hold chunk. Returns 0 if heap can't grow.
+ */
+int mm_heap_grow(PDATA data, size_t grow, size_t least)
+{
+	if(mm_heap_full(grow) || mem_sbrk(grow) == (void *)-1)
+	{
+		if(grow == least || mm_heap_full(least) || mem_sbrk(least) == (void *)-1)
+		{
+			return 0;
+		}
+		grow = least;
+	}
+	data->end += grow;
+	data->sbrk_count++;
+	return 1;
+}
+
+/* 
+ * mm_heap_sbrk
+ * Extends last span of current arena in place, bumping end of list within heap reserved ahead and reserving chunk of mm_chunk_size when it runs out. Without arena mode, whole heap is the only span.
+ */
+void *mm_heap_sbrk(size_t size)
+{
+	char *brk;
+	size_t least;
+	PDATA data;
+#if MM_ARENA
+	struct MM_Arenas *arenas;
+#endif
+
+	// get data field
+	data = mm_get_data();
+	if(data->brk + size > data->end)
+	{
+		least = data->brk + size - data->end;
+#if MM_ARENA
+		// only span at the top of heap can grow beyond its reservation; mm_arena_chain starts new one for others
+		arenas = (struct MM_Arenas *)mem_heap_lo();
+		pthread_mutex_lock(&arenas->lock);
+		if(data->end != (char *)mem_heap_hi() + 1 || !mm_heap_grow(data, mm_chunk_size(least), least))
+		{
+			pthread_mutex_unlock(&arenas->lock);
+			return (void *)-1;
+		}
+		pthread_mutex_unlock(&arenas->lock);
+#else
+		if(!mm_heap_grow(data, mm_chunk_size(least), least))
+		{
+			return (void *)-1;
+		}
+#endif
+	}
+	brk = data->brk;
+	data->brk += size;
+	data->heap_bytes += size;
+	return brk;
+}
+
+/* 
+ * mm_sbrk
+ * Grows list of current arena by segment of size. This function is for maintaining spatial efficiency; list grows by at least MM_UNIT and the rest is inserted into red-black tree. Heap reserved ahead by mm_heap_sbrk stays beyond end of list, so it never changes placement of segments. Returns NULL if heap can't grow.
+ */
+PNODE mm_sbrk(size_t size)
+{
+	size_t least;
+	void *brk;
+	PNODE ptr;
+
+	// if size to mem_sbrk is too small, expand it
+	least = size < MM_UNIT ? MM_UNIT : size;
+	if(size < MM_UNIT)
+	{
+		size = ALIGN(size + MM_HEADER_SIZE);
+	}
+
+	if((brk = mm_heap_sbrk(least)) == (void *)-1)
+	{
+		return NULL;
+	}
+
+	// new segment begins at old end of list, whose prev is already set
+	ptr = (PNODE)(brk - MM_HEADER_SIZE);
+	ptr->size = least >> MM_ALIGN;
+	// clear new footer
+	mm_clear_header((void *)ptr + least);
+
+	// split segment
+	ptr->alloc = MM_ALLOC_ALLOC;
+	ptr = mm_frag_node(ptr, size >> MM_ALIGN);
+
+	// return new segment has size of size
+	return ptr;
+}
+
+/* 
+ * mm_small_push
+ * Push segment into exact-fit free list of its size. Segment keeps its alloc bit, so neighbors never coalesce with it while it's in the list. Left field is used as next pointer.
+ */
+void mm_small_push(PNODE now)
+{
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	// push at head; LIFO
+	now->left = mm_ref(data->small[now->size - MM_SMALL_MIN]);
+	data->small[now->size - MM_SMALL_MIN] = now;
+	data->free_bytes += (size_t)now->size << MM_ALIGN;
+}
+
+/* 
+ * mm_small_pop
+ * Pop segment of exactly given size from free list. Returns NULL if list is empty.
+ */
+PNODE mm_small_pop(size_t size)
+{
+	PNODE ptr;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	ptr = data->small[size - MM_SMALL_MIN];
+	if(ptr != NULL)
+	{
+		data->small[size - MM_SMALL_MIN] = MM_LEFT(ptr);
+		data->free_bytes -= size << MM_ALIGN;
+	}
+	return ptr;
+}
+
+/* 
+ * mm_trim
+ * Shrinks heap by free segment at the end of heap, and by heap reserved beyond it. Header of segment becomes new end of list.
+ */
+void mm_trim(PNODE now)
+{
+	size_t size;
+	PNODE prev;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	size = (size_t)now->size << MM_ALIGN;
+	prev = MM_PREV(now);
+
+	// clear new header
+	mm_clear_header(now);
+	now->prev = mm_ref(prev);
+
+	// heap reserved ahead goes back too
+	mem_sbrk(-(intptr_t)(size + (data->end - data->brk)));
+	data->brk -= size;
+	data->end = data->brk;
+	data->heap_bytes -= size;
+}
+
+/* 
+ * mm_defer_push
+ * Push segment into unsorted list of deferred segments. Segment keeps its alloc bit and is tagged with null bit, so only mm_coalesce merges it. Left field is used as next pointer and right field as previous pointer.
+ */
+void mm_defer_push(PNODE now)
+{
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	now->null = MM_NULL_NULL;
+	now->left = mm_ref(data->defer);
+	now->right = 0;
+	if(data->defer != NULL)
+	{
+		data->defer->right = mm_ref(now);
+	}
+	data->defer = now;
+	data->defer_count++;
+	data->free_bytes += (size_t)now->size << MM_ALIGN;
+}
+
+/* 
+ * mm_defer_unlink
+ * Unlink segment from list of deferred segments and clear its tag.
+ */
+void mm_defer_unlink(PNODE now)
+{
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+	if(now->right != 0)
+	{
+		MM_RIGHT(now)->left = now->left;
+	}
+	else
+	{
+		data->defer = MM_LEFT(now);
+	}
+	if(now->left != 0)
+	{
+		MM_LEFT(now)->right = now->right;
+	}
+	now->null = MM_NULL_NOTNULL;
+	data->defer_count--;
+	data->free_bytes -= (size_t)now->size << MM_ALIGN;
+}
+
+/* 
+ * mm_is_free
+ * Returns 1 if segment is free or deferred.
+ */
+int mm_is_free(PNODE now)
+{
+	return now->alloc == MM_ALLOC_FREE || now->null == MM_NULL_NULL;
+}
+
+/* 
+ * mm_unlink_free
+ * Takes free or deferred segment out of red-black tree or list of deferred segments, so it can be coalesced. Returns 0 if segment is in use.
+ */
+int mm_unlink_free(PNODE now)
+{
+	if(now->alloc == MM_ALLOC_FREE)
+	{
+		mm_delete(now);
+		return 1;
+	}
+	if(now->null == MM_NULL_NULL)
+	{
+		mm_defer_unlink(now);
+		return 1;
+	}
+	return 0;
+}
+
+/* 
+ * mm_heap_end
+ * Get end of list, which is header of size 0 at the end of current arena.
+ */
+PNODE mm_heap_end()
+{
+	return (PNODE)(mm_get_data()->brk - MM_HEADER_SIZE);
+}
+
+/* 
+ * mm_heap_span
+ * Get first segment of next span of arena, searching span array from *i; NULL if there's no more. Without arena mode, heap is the only span.
+ */
+PNODE mm_heap_span(PDATA data, int *i)
+{
+#if MM_ARENA
+	struct MM_Arenas *arenas;
+
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	for(; *i < arenas->spans; (*i)++)
+	{
+		if(arenas->arena[arenas->span[*i].arena] == data)
+		{
+			return mm_node(arenas->span[(*i)++].span);
+		}
+	}
+	return NULL;
+#else
+	return (*i)++ == 0 ? (PNODE)((void *)data + MM_DATA_SIZE) : NULL;
+#endif
+}
+
+/* 
+ * mm_extend
+ * Allocates segment of size at the end of heap. If last segment is free or deferred, heap grows only by the rest and they're merged, instead of leaving free segment uncoalesced below new one. Returns NULL if heap can't grow.
+ */
+PNODE mm_extend(size_t size)
+{
+	PNODE last, ptr;
+
+	// small free segment is left for small requests
+	last = MM_PREV(mm_heap_end());
+	if(last == NULL || last->size <= MM_SMALL_MAX || last->size >= size || !mm_unlink_free(last))
+	{
+		return mm_sbrk(size << MM_ALIGN);
+	}
+
+	if((ptr = mm_sbrk((size - last->size) << MM_ALIGN)) == NULL)
+	{
+		// put it back
+		last->alloc = MM_ALLOC_FREE;
+		mm_insert(last);
+		return NULL;
+	}
+
+	// merge new segment
+	last->size += ptr->size;
+	last->alloc = MM_ALLOC_ALLOC;
+	mm_get_next(last)->prev = mm_ref(last);
+	mm_get_data()->sbrk_merged++;
+	return last;
+}
+
+/* 
+ * mm_coalesce
+ * Looks previous and next segments if they are free os they can coalesced. Resulting segment is inserted into red-black tree.
+ * Adjacent deferred segments are coalesced as well, so runs of them are merged at once.
+ */
+void mm_coalesce(PNODE now)
+{
+	PNODE prev, next;
+
+	// while previous segment is free, delete it and coalesce
+	while((prev = mm_get_prev(now)) != NULL && mm_unlink_free(prev))
+	{
+		prev->size += now->size;
+		now = prev;
+	}
+	// while next segment is free, delete it and coalesce
+	while((next = mm_get_next(now))->size != 0 && mm_unlink_free(next))
+	{
+		now->size += next->size;
+	}
+
+	// set alloc bit
+	now->alloc = MM_ALLOC_FREE;
+	// insert into list
+	mm_get_next(now)->prev = mm_ref(now);
+
+#if !MM_ARENA
+	// give back big segment at the end of heap
+	if(mm_get_next(now)->size == 0 && ((size_t)now->size << MM_ALIGN) >= MM_TRIM)
+	{
+		mm_trim(now);
+		return;
+	}
+#endif
+
+	// insert into red-black tree
+	mm_insert(now);
+	// pages inside big segment are not needed until it's allocated again
+	if(((size_t)now->size << MM_ALIGN) >= MM_RELEASE)
+	{
+		mem_release((void *)now + MM_NODE_SIZE, ((size_t)now->size << MM_ALIGN) - MM_NODE_SIZE);
+	}
+}
+
+/* 
+ * mm_small_flush
+ * Moves every segment in exact-fit free lists into red-black tree with coalescing. Called when red-black tree can't satisfy request, before heap grows.
+ */
+int mm_small_flush()
+{
+	int i, cnt;
+	PNODE ptr;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+
+	cnt = 0;
+	for(i = 0; i < MM_SMALL_COUNT; i++)
+	{
+		while((ptr = data->small[i]) != NULL)
+		{
+			data->small[i] = MM_LEFT(ptr);
+			data->free_bytes -= (size_t)ptr->size << MM_ALIGN;
+			mm_coalesce(ptr);
+			cnt++;
+		}
+	}
+
+	// returns number of segments moved
+	return cnt;
+}
+
+/* 
+ * mm_defer_flush
+ * Sweeps list of deferred segments into red-black tree with coalescing. Called when list is full, or red-black tree can't satisfy request.
+ */
+int mm_defer_flush()
+{
+	int cnt;
+	PNODE ptr;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+
+	cnt = 0;
+	while((ptr = data->defer) != NULL)
+	{
+		mm_defer_unlink(ptr);
+		mm_coalesce(ptr);
+		cnt++;
+	}
+
+	// returns number of segments swept, without ones merged into others
+	return cnt;
+}
+
+/* 
+ * mm_check_node
+ * Tours nodes in red-black tree. Recursively implemented.
+ */
+int mm_check_node(PNODE now, int *cnt)
+{
+	if(now->null == MM_NULL_NULL)
+	{
+		return 1;
+	}
+
+	(*cnt)++;
+
+	// check if it's valid binary search tree
+	if(MM_LEFT(now)->null == MM_NULL_NOTNULL && mm_cmp_node(now, MM_LEFT(now)))
+	{
+		mm_print_error("RBTree Broken!\n");
+		return 0;
+	}
+	if(MM_RIGHT(now)->null == MM_NULL_NOTNULL && mm_cmp_node(MM_RIGHT(now), now))
+	{
+		mm_print_error("RBTree Broken!\n");
+		return 0;
+	}
+
+	// check if it's valid red-black tree
+	if(now->color == MM_COLOR_RED && (MM_LEFT(now)->color == MM_COLOR_RED || MM_RIGHT(now)->color == MM_COLOR_RED))
+	{
+		mm_print_error("RBTree Broken!\n");
+		return 0;
+	}
+
+	return mm_check_node(MM_LEFT(now), cnt) & mm_check_node(MM_RIGHT(now), cnt);
+}
+
+#if MM_BITMAP
+/* 
+ * mm_check_bin
+ * Checks red-black tree of bin, its bits in bitmaps, and if every node belongs to the bin.
+ */
+int mm_check_bin(PDATA data, unsigned int fl, unsigned int sl, int *cnt)
+{
+	unsigned int i, j, k, l;
+	PNODE root, last;
+
+	root = mm_node(data->bin[fl][sl]);
+	if((root->null == MM_NULL_NOTNULL) != ((data->sl_map[fl] >> sl) & 1) || (data->sl_map[fl] != 0) != ((data->fl_map >> fl) & 1))
+	{
+		mm_print_error("Bitmap Broken!\n");
+		return 0;
+	}
+
+	if(mm_check_node(root, cnt) == 0)
+	{
+		return 0;
+	}
+	if(root->null == MM_NULL_NULL)
+	{
+		return 1;
+	}
+
+	// least and greatest nodes bound every node of tree
+	for(last = root; MM_RIGHT(last)->null == MM_NULL_NOTNULL; last = MM_RIGHT(last));
+	mm_bin_index(mm_first_node(root)->size, &i, &j);
+	mm_bin_index(last->size, &k, &l);
+	if(i != fl || j != sl || k != fl || l != sl)
+	{
+		mm_print_error("Bitmap Broken!\n");
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+/* 
+ * mm_check
+ * First checks heap sequently if any exception occured. Adjacent free segment is okay; they are part of strategies. Second it checks red-black tree.
+ */
+int mm_check()
+{
+	int i, nfree, nnode, ndefer;
+#if MM_BITMAP
+	int j;
+#endif
+	size_t heap, free;
+	PNODE now, prev;
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+
+	// count free nodes, and bytes of list and free segments
+	nfree = nnode = ndefer = 0;
+	heap = free = 0;
+	// begin from first node of every span, tour all nodes sequently.
+	for(i = 0; (now = mm_heap_span(data, &i)) != NULL; )
+	{
+		// first node of span has no previous one
+		if(now->prev != 0)
+		{
+			mm_print_error("Linked List Broken!\n");
+			return 0;
+		}
+		for(; now->size != 0; now = mm_get_next(now))
+		{
+			// check if it's valid double-linked list
+			if(MM_PREV(mm_get_next(now)) != now)
+			{
+				mm_print_error("Linked List Broken!\n");
+				return 0;
+			}
+			heap += (size_t)now->size << MM_ALIGN;
+			if(mm_is_free(now))
+			{
+				free += (size_t)now->size << MM_ALIGN;
+			}
+			// count free nodes; none is tagged as mapped
+			if(now->alloc == MM_ALLOC_FREE)
+			{
+				if(mm_is_mapped((void *)now + MM_HEADER_SIZE))
+				{
+					mm_print_error("Free Node Tagged as Mapped!\n");
+					return 0;
+				}
+				nfree++;
+			}
+			// count deferred nodes
+			else if(now->null == MM_NULL_NULL)
+			{
+				ndefer++;
+			}
+		}
+	}
+
+	// check red-black tree
+#if MM_BITMAP
+	for(i = 0; i < MM_FL_COUNT; i++)
+	{
+		for(j = 0; j < MM_SL_COUNT; j++)
+		{
+			if(mm_check_bin(data, i, j, &nnode) == 0)
+			{
+				return 0;
+			}
+		}
+	}
+#else
+	if(mm_check_node(data->root, &nnode) == 0)
+	{
+		return 0;
+	}
+#endif
+
+	// check counts
+	if(nfree != nnode)
+	{
+		mm_print_error("List and RBTree doesn't match!\n");
+		return 0;
+	}
+
+	// check exact-fit free lists
+	for(i = 0; i < MM_SMALL_COUNT; i++)
+	{
+		for(now = data->small[i]; now != NULL; now = MM_LEFT(now))
+		{
+			if(now->alloc != MM_ALLOC_ALLOC || now->size != i + MM_SMALL_MIN)
+			{
+				mm_print_error("Small List Broken!\n");
+				return 0;
+			}
+			free += (size_t)now->size << MM_ALIGN;
+		}
+	}
+
+	// check list of deferred segments; none may pass for mapped one
+	for(prev = NULL, now = data->defer; now != NULL; prev = now, now = MM_LEFT(now))
+	{
+		if(mm_is_mapped((void *)now + MM_HEADER_SIZE))
+		{
+			mm_print_error("Deferred Node Tagged as Mapped!\n");
+			return 0;
+		}
+		if(now->alloc != MM_ALLOC_ALLOC || now->null != MM_NULL_NULL || MM_RIGHT(now) != prev)
+		{
+			mm_print_error("Deferred List Broken!\n");
+			return 0;
+		}
+		ndefer--;
+	}
+	if(ndefer != 0 || (prev == NULL) != (data->defer_count == 0))
+	{
+		mm_print_error("List and Deferred List doesn't match!\n");
+		return 0;
+	}
+
+	// check byte counts chunk is based on
+	if(heap != data->heap_bytes || free != data->free_bytes)
+	{
+		mm_print_error("Byte Counts don't match!\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/* 
+ * mm_stats_height
+ * Get height of red-black tree. Recursively implemented.
+ */
+int mm_stats_height(PNODE now)
+{
+	int left, right;
+
+	if(now->null == MM_NULL_NULL)
+	{
+		return 0;
+	}
+	left = mm_stats_height(MM_LEFT(now));
+	right = mm_stats_height(MM_RIGHT(now));
+	return 1 + (left > right ? left : right);
+}
+
+/* 
+ * mm_stats_tree
+ * Adds height and black height of red-black tree to statistics, keeping greatest ones. Every path has same black height, so leftmost one is counted.
+ */
+void mm_stats_tree(PNODE root, struct MM_Stats *stats)
+{
+	int height, black;
+	PNODE now;
+
+	height = mm_stats_height(root);
+	for(black = 0, now = root; now->null == MM_NULL_NOTNULL; now = MM_LEFT(now))
+	{
+		black += now->color == MM_COLOR_BLACK;
+	}
+	stats->tree_height = height > stats->tree_height ? height : stats->tree_height;
+	stats->black_height = black > stats->black_height ? black : stats->black_height;
+}
+
+/* 
+ * mm_stats_free
+ * Adds free segment to statistics and its size histogram.
+ */
+void mm_stats_free(PNODE now, struct MM_Stats *stats)
+{
+	int i;
+	size_t size;
+
+	size = (size_t)now->size << MM_ALIGN;
+	stats->free_bytes += size;
+	stats->free_count++;
+	if(size > stats->largest_free)
+	{
+		stats->largest_free = size;
+	}
+	for(i = 0; i < MM_STATS_BINS - 1 && size >= ((size_t)32 << i); i++);
+	stats->hist[i]++;
+}
+
+/* 
+ * mm_get_stats
+ * Get shape of heap of current arena: free segments in red-black trees, exact-fit free lists and deferred list, heights of red-black trees, and adjacent free segments, which mm_sbrk and deferred coalescing leave behind. Tours whole heap, so it's as slow as mm_check.
+ */
+void mm_get_stats(struct MM_Stats *stats)
+{
+	int i, last;
+#if MM_BITMAP
+	int j;
+#endif
+	PNODE now;
+	PDATA data;
+
+	memset(stats, 0, sizeof(*stats));
+	if((data = mm_get_data()) == NULL)
+	{
+		return;
+	}
+	stats->heap_bytes = mem_heapsize();
+	stats->sbrk_count = data->sbrk_count;
+	stats->sbrk_merged = data->sbrk_merged;
+	stats->chunk = data->chunk;
+
+	// segments in red-black trees and deferred list, and adjacent pairs of them in every span
+	for(i = 0; (now = mm_heap_span(data, &i)) != NULL; )
+	{
+		for(last = 0; now->size != 0; now = mm_get_next(now))
+		{
+			if(mm_is_free(now))
+			{
+				mm_stats_free(now, stats);
+				stats->adjacent_free += last;
+				last = 1;
+			}
+			else
+			{
+				last = 0;
+			}
+		}
+	}
+
+	// segments in exact-fit free lists look allocated in heap
+	for(i = 0; i < MM_SMALL_COUNT; i++)
+	{
+		for(now = data->small[i]; now != NULL; now = MM_LEFT(now))
+		{
+			mm_stats_free(now, stats);
+		}
+	}
+
+#if MM_BITMAP
+	for(i = 0; i < MM_FL_COUNT; i++)
+	{
+		for(j = 0; j < MM_SL_COUNT; j++)
+		{
+			mm_stats_tree(mm_node(data->bin[i][j]), stats);
+		}
+	}
+#else
+	mm_stats_tree(data->root, stats);
+#endif
+
+	if(stats->free_bytes != 0)
+	{
+		stats->frag = 1.0 - (double)stats->largest_free / stats->free_bytes;
+	}
+}
+
+/* 
+ * mm_init_data
+ * Initializes data field and red-black tree.
+ */
+void mm_init_data(PDATA data)
+{
+#if MM_BITMAP
+	int i, j;
+#endif
+
+	memset(data, 0, MM_DATA_SIZE);
+
+	// init data
+#if MM_BITMAP
+	for(i = 0; i < MM_FL_COUNT; i++)
+	{
+		for(j = 0; j < MM_SL_COUNT; j++)
+		{
+			data->bin[i][j] = mm_ref(&data->null);
+		}
+	}
+#else
+	data->root = &data->null;
+#endif
+	data->null.color = MM_COLOR_BLACK;
+	data->null.null = MM_NULL_NULL;
+	data->chunk = MM_UNIT;
+}
+
+#if MM_ARENA
+/* 
+ * mm_arena_owner
+ * Get arena which segment of given pointer belongs to. Binary search for last span beginning at or below pointer, since spans are sorted by address.
+ */
+PDATA mm_arena_owner(void *ptr)
+{
+	int lo, hi, mid;
+	struct MM_Span *span;
+	struct MM_Arenas *arenas;
+
+	// count is read before array, so array holds every span counted
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	hi = __atomic_load_n(&arenas->spans, __ATOMIC_ACQUIRE) - 1;
+	span = __atomic_load_n(&arenas->span, __ATOMIC_ACQUIRE);
+	for(lo = 0; lo < hi; )
+	{
+		mid = (lo + hi + 1) / 2;
+		if((void *)mm_node(span[mid].span) > ptr)
+		{
+			hi = mid - 1;
+		}
+		else
+		{
+			lo = mid;
+		}
+	}
+	return arenas->arena[span[lo].arena];
+}
+
+/* 
+ * mm_arena_room
+ * Makes room for one more span in span array, moving it into twice as large one at the top of heap if it's full. Lock of arenas must be held, and it must be called before span itself is carved, so span stays at the top. Returns 0 if heap can't hold new array.
+ */
+int mm_arena_room(struct MM_Arenas *arenas)
+{
+	size_t len;
+	struct MM_Span *span;
+
+	if(arenas->spans < arenas->span_max)
+	{
+		return 1;
+	}
+
+	len = ALIGN(2 * arenas->span_max * sizeof(struct MM_Span));
+	if(mm_heap_full(len) || (span = (struct MM_Span *)mem_sbrk(len)) == (void *)-1)
+	{
+		return 0;
+	}
+	memcpy(span, arenas->span, arenas->spans * sizeof(struct MM_Span));
+
+	// publish copy before it's used, since mm_arena_owner reads it without lock
+	__sync_synchronize();
+	arenas->span = span;
+	arenas->span_max *= 2;
+	return 1;
+}
+
+/* 
+ * mm_arena_span
+ * Appends span beginning with segment now to span array, which mm_arena_room has made room in. Lock of arenas must be held.
+ */
+void mm_arena_span(struct MM_Arenas *arenas, PNODE now, int arena)
+{
+	// clear new header
+	mm_clear_header(now);
+
+	// publish span before count, since mm_arena_owner reads them without lock
+	arenas->span[arenas->spans].span = mm_ref(now);
+	arenas->span[arenas->spans].arena = arena;
+	__sync_synchronize();
+	arenas->spans++;
+}
+
+/* 
+ * mm_arena_chain
+ * Starts new span of current arena at the top of heap, when other arena is above its last span. Rest of reservation of last span becomes free segment. New span reserves ahead, doubling from MM_ARENA_STEP up to MM_ARENA_SIZE, so arenas growing in turn don't chain span for every growth. Returns 0 if heap can't hold size.
+ */
+int mm_arena_chain(size_t size)
+{
+	int i;
+	size_t len;
+	char *lo;
+	PNODE now;
+	PDATA data;
+	struct MM_Arenas *arenas;
+
+	// get data field
+	data = mm_get_data();
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	// mm_sbrk grows by MM_UNIT at least
+	size = size < MM_UNIT ? MM_UNIT : size;
+
+	pthread_mutex_lock(&arenas->lock);
+	for(i = 0; arenas->arena[i] != data; i++);
+
+	// span begins after pad, so payloads stay aligned; reserve ahead if heap can hold it
+	lo = (void *)-1;
+	len = size > data->reserve ? size : data->reserve;
+	if(mm_arena_room(arenas) && (mm_heap_full(ALIGNMENT + len) || (lo = mem_sbrk(ALIGNMENT + len)) == (void *)-1))
+	{
+		len = size;
+		if(!mm_heap_full(ALIGNMENT + len))
+		{
+			lo = mem_sbrk(ALIGNMENT + len);
+		}
+	}
+	if(lo == (void *)-1)
+	{
+		pthread_mutex_unlock(&arenas->lock);
+		return 0;
+	}
+	mm_arena_span(arenas, (PNODE)(lo + ALIGNMENT - MM_HEADER_SIZE), i);
+	pthread_mutex_unlock(&arenas->lock);
+
+	// rest of last span becomes free segment
+	if(data->end - data->brk >= MM_NODE_SIZE)
+	{
+		now = (PNODE)(data->brk - MM_HEADER_SIZE);
+		now->size = (data->end - data->brk) >> MM_ALIGN;
+		now->alloc = MM_ALLOC_ALLOC;
+		mm_clear_header(data->end - MM_HEADER_SIZE);
+		data->heap_bytes += data->end - data->brk;
+		data->brk = data->end;
+		mm_coalesce(now);
+	}
+
+	data->brk = lo + ALIGNMENT;
+	data->end = lo + ALIGNMENT + len;
+	data->reserve = data->reserve * 2 < MM_ARENA_SIZE ? data->reserve * 2 : MM_ARENA_SIZE;
+	return 1;
+}
+
+/* 
+ * mm_arena_bind
+ * Binds calling thread to arena in round-robin order. Arena is carved from heap when it's bound first time; it reserves nothing more until it grows.
+ */
+PDATA mm_arena_bind()
+{
+	int i;
+	PDATA data;
+	struct MM_Arenas *arenas;
+
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	pthread_mutex_lock(&arenas->lock);
+
+	i = arenas->next++ % MM_ARENA_COUNT;
+	if(i >= arenas->count)
+	{
+		// carve new arena with its first span; if heap is exhausted, share existing one
+		if(mm_arena_room(arenas) && !mm_heap_full(MM_DATA_SIZE + MM_HEADER_SIZE) && (data = (PDATA)mem_sbrk(MM_DATA_SIZE + MM_HEADER_SIZE)) != (void *)-1)
+		{
+			mm_init_data(data);
+			pthread_mutex_init(&data->lock, NULL);
+			data->brk = data->end = (char *)data + MM_DATA_SIZE + MM_HEADER_SIZE;
+			data->reserve = MM_ARENA_STEP;
+
+			// publish arena before its span
+			arenas->arena[arenas->count] = data;
+			mm_arena_span(arenas, (PNODE)((void *)data + MM_DATA_SIZE), arenas->count);
+			i = arenas->count++;
+		}
+		else if(arenas->count == 0)
+		{
+			pthread_mutex_unlock(&arenas->lock);
+			return NULL;
+		}
+		else
+		{
+			i %= arenas->count;
+		}
+	}
+
+	pthread_mutex_unlock(&arenas->lock);
+
+	mm_thread_arena = arenas->arena[i];
+	mm_thread_epoch = mm_epoch;
+	return mm_thread_arena;
+}
+
+/* 
+ * mm_arena_current
+ * Get arena bound to calling thread. Binds new one if thread isn't bound since last mm_init.
+ */
+PDATA mm_arena_current()
+{
+	if(mm_thread_epoch != mm_epoch || mm_thread_arena == NULL)
+	{
+		return mm_arena_bind();
+	}
+	return mm_thread_arena;
+}
+
+/* 
+ * mm_arena_remote
+ * Pushes segment into remote stack of owner arena. Lock-free; owner drains the stack when it takes its lock.
+ */
+void mm_arena_remote(PDATA owner, PNODE now)
+{
+	PNODE head;
+
+	do
+	{
+		head = owner->remote;
+		now->left = mm_ref(head);
+	}
+	while(!__sync_bool_compare_and_swap(&owner->remote, head, now));
+}
+#endif
+
+/* 
+ * mm_init
+ * Allocates heap for data and node header. In arena mode, only header of arenas is allocated; arenas are carved when threads are bound.
+ */
+int mm_init()
+{
+#if MM_ARENA
+	struct MM_Arenas *arenas;
+#else
+	PDATA data;
+#endif
+
+	// references are relative to beginning of heap
+	mm_base = mem_heap_lo();
+
+#if MM_ARENA
+	// allocate header of arenas
+	arenas = (struct MM_Arenas *)mem_sbrk(MM_ARENAS_SIZE);
+	memset(arenas, 0, MM_ARENAS_SIZE);
+	pthread_mutex_init(&arenas->lock, NULL);
+	arenas->span = arenas->span_head;
+	arenas->span_max = MM_SPAN_COUNT;
+
+	// unbind every thread
+	mm_epoch++;
+#else
+	// allocate data
+	data = (PDATA)mem_sbrk(MM_DATA_SIZE);
+	mm_init_data(data);
+
+	// clear new header, which is end of list
+	mm_clear_header(mem_sbrk(MM_HEADER_SIZE));
+	data->brk = data->end = (char *)mem_heap_hi() + 1;
+#endif
+
+	return 0;
+}
+
+/* 
+ * mm_grow_release
+ * Gives headroom of growing segment back to red-black tree. Called when another segment starts growing or heap can't satisfy request.
+ */
+void mm_grow_release()
+{
+	PDATA data;
+	PNODE now;
+
+	// get data field
+	data = mm_get_data();
+
+	if((now = data->grow) != NULL)
+	{
+		data->grow = NULL;
+		mm_frag_node(now, data->grow_size);
+	}
+}
+
+/* 
+ * mm_grow_track
+ * Marks segment grown by mm_realloc. If it has headroom beyond requested size, it becomes growing segment of data field instead of previous one. Returns pointer of payload.
+ */
+void *mm_grow_track(PNODE now, size_t size)
+{
+	PDATA data;
+
+	// get data field
+	data = mm_get_data();
+
+	now->color = MM_GROW_GROWN;
+	if(now->size > size && size > MM_SMALL_MAX)
+	{
+		if(data->grow != now)
+		{
+			mm_grow_release();
+		}
+		data->grow = now;
+		data->grow_size = size;
+	}
+
+	return (void *)now + MM_HEADER_SIZE;
+}
+
+/* 
+ * mm_malloc_arena
+ * Allocates in current arena. First searches in red-black tree, which keyed with segment's size. If there is free segment bigger than requested size, program returns it's pointer. Else, program calls mem_sbrk() and returns it.
+ */
+void *mm_malloc_arena(size_t size)
+{
+	PNODE ptr;
+
+	// convert size; segment must be big enough to be a node when it's freed
+	size = ALIGN(size + MM_HEADER_SIZE) >> MM_ALIGN;
+	if(size < MM_SMALL_MIN)
+	{
+		size = MM_SMALL_MIN;
+	}
+
+	// small segment of exact size might be in free list
+	if(size >= MM_SMALL_MIN && size <= MM_SMALL_MAX && (ptr = mm_small_pop(size)) != NULL)
+	{
+		return (void *)ptr + MM_HEADER_SIZE;
+	}
+
+	// search if free segment available
+	ptr = mm_search(size);
+	// flush free lists and deferred segments into red-black tree and search again
+	if(ptr == NULL && mm_small_flush() + mm_defer_flush() != 0)
+	{
+		ptr = mm_search(size);
+	}
+	// take back headroom of growing segment and search again
+	if(ptr == NULL && mm_get_data()->grow != NULL)
+	{
+		mm_grow_release();
+		ptr = mm_search(size);
+	}
+
+	// there's no segment bigger than size
+	if(ptr == NULL)
+	{
+		// newly allocate, merged with free segment at the end of heap
+		ptr = mm_extend(size);
+#if MM_ARENA
+		// other arena is above last span; continue in new span
+		if(ptr == NULL && mm_arena_chain(size << MM_ALIGN))
+		{
+			ptr = mm_extend(size);
+		}
+#endif
+		if(ptr == NULL)
+		{
+			return NULL;
+		}
+	}
+	// segment found
+	else
+	{
+		// delete from red-black tree
+		mm_delete(ptr);
+		// split if too big
+		ptr = mm_frag_node(ptr, size);
+		// set alloc bit
+		ptr->alloc = MM_ALLOC_ALLOC;
+	}
+
+	return (void *)ptr + MM_HEADER_SIZE;
+}
+
+/* 
+ * mm_free_arena
+ * Frees in current arena. Small segment is pushed into exact-fit free list without coalescing. Others are coalesced and inserted into red-black tree, or pushed into list of deferred segments in deferred mode.
+ */
+void mm_free_arena(void *ptr)
+{
+	PNODE now;
+
+	// convert pointer
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+
+	// growing segment stops growing
+	if(now == mm_get_data()->grow)
+	{
+		mm_get_data()->grow = NULL;
+	}
+
+	// small segment goes to free list
+	if(now->size >= MM_SMALL_MIN && now->size <= MM_SMALL_MAX)
+	{
+		mm_small_push(now);
+		return;
+	}
+
+	// sweep deferred segments in batch when list is full
+	if(mm_deferred)
+	{
+		mm_defer_push(now);
+		if(mm_get_data()->defer_count >= MM_DEFER_MAX)
+		{
+			mm_defer_flush();
+		}
+		return;
+	}
+
+	mm_coalesce(now);
+}
+
+/* 
+ * mm_expand_prev
+ * Expands segment backward into free previous segment, together with free following segments as needed. Payload is moved down with mm_memmove and previous segment becomes the allocated one.
+ */
+void *mm_expand_prev(PNODE prev, PNODE now, size_t size)
+{
+	size_t len;
+	PNODE next;
+
+	len = ((size_t)now->size << MM_ALIGN) - MM_HEADER_SIZE;
+
+	// coalesce previous and following free segments
+	mm_unlink_free(prev);
+	for(next = mm_get_next(now); next->size != 0 && mm_is_free(next) && prev->size + now->size < size; next = mm_get_next(next))
+	{
+		mm_unlink_free(next);
+		now->size += next->size;
+	}
+	prev->size += now->size;
+	prev->alloc = MM_ALLOC_ALLOC;
+	mm_get_next(prev)->prev = mm_ref(prev);
+
+	// move payload; headers of now and following segments are overwritten
+	mm_memmove((void *)prev + MM_HEADER_SIZE, (void *)now + MM_HEADER_SIZE, len);
+
+	// split if too big
+	prev = mm_frag_node(prev, size);
+
+	return (void *)prev + MM_HEADER_SIZE;
+}
+
+/* 
+ * mm_realloc_arena
+ * Reallocates in current arena. There are three cases: segment shrinks, expands, re-alloceted. Requested segment is expanded when following segment is available, or backward into free previous segment. Segment grown more than once gets 1/64 of headroom, which is kept while it grows within it.
+ */
+void *mm_realloc_arena(void *ptr, size_t size)
+{
+	size_t osize, sum, want;
+	PNODE now, prev, next, new;
+	PDATA data;
+
+	// handle exceptions
+	if(ptr == NULL)
+	{
+		return mm_malloc_arena(size);
+	}
+	if(size == 0)
+	{
+		mm_free_arena(ptr);
+		return ptr;
+	}
+
+	// convert size
+	osize = size;
+	size = ALIGN(size + MM_HEADER_SIZE) >> MM_ALIGN;
+	// convert pointer
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+
+	// growing segment keeps its headroom as long as it doesn't shrink
+	data = mm_get_data();
+	if(now == data->grow)
+	{
+		data->grow = NULL;
+		if(size <= now->size && size >= data->grow_size)
+		{
+			mm_grow_track(now, size);
+			return ptr;
+		}
+	}
+
+	// shrink case
+	if(size <= now->size)
+	{
+		// now->alloc = MM_ALLOC_ALLOC;
+		// split if too big
+		now = mm_frag_node(now, size);
+		return ptr;
+	}
+
+	// segment grown before reserves headroom
+	want = size;
+	if(now->color == MM_GROW_GROWN && size > MM_SMALL_MAX && size + (size >> MM_GROW_SHIFT) <= (MM_SIZE_MAX >> MM_ALIGN))
+	{
+		want = size + ((size >> MM_GROW_SHIFT) & ~(size_t)((ALIGNMENT >> MM_ALIGN) - 1));
+	}
+
+	// check following segments
+	sum = now->size;
+	for(next = mm_get_next(now); next->size != 0 && mm_is_free(next) && sum < want; next = mm_get_next(next))
+	{
+		sum += next->size;
+	}
+
+	// free previous segment makes up the rest; payload slides down into it
+	prev = mm_get_prev(now);
+	if(sum < size && prev != NULL && mm_is_free(prev) && prev->size + sum >= size)
+	{
+		ptr = mm_expand_prev(prev, now, want);
+		return mm_grow_track(ptr - MM_HEADER_SIZE, size);
+	}
+
+	// if segment is at the end of heap; in arena mode, it must be in last span
+	if(sum < want && next == mm_heap_end())
+	{
+		// newly allocate lacking memory
+		next = mm_sbrk((want - sum) << MM_ALIGN);
+		if(next != NULL)
+		{
+			// insert into heap; this might cause temporarily uncoalesced free segments
+			next->alloc = MM_ALLOC_FREE;
+			mm_insert(next);
+			sum = want;
+		}
+	}
+	// re-allocation case; else, expand case
+	if(sum < size)
+	{
+		// newly allocate
+		new = mm_malloc_arena(want > size ? (want << MM_ALIGN) - MM_HEADER_SIZE : osize);
+		if(new == NULL)
+		{
+			return NULL;
+		}
+		// copy datas
+		mm_memcpy(new, ptr, ((size_t)now->size << MM_ALIGN) - MM_HEADER_SIZE);
+		// free existing segment
+		mm_free_arena(ptr);
+		// return new segment
+		return mm_grow_track((PNODE)((void *)new - MM_HEADER_SIZE), size);
+	}
+
+	// coalesce following free segments
+	for(next = mm_get_next(now); next->size != 0 && mm_is_free(next) && now->size < want; next = mm_get_next(next))
+	{
+		mm_unlink_free(next);
+		now->size += next->size;
+	}
+	// insert into list
+	mm_get_next(now)->prev = mm_ref(now);
+
+	return mm_grow_track(now, size);
+}
+
+/* 
+ * mm_malloc_align_arena
+ * Allocates in current arena with payload aligned to align, which is power of 2. Segment is allocated with room for alignment, and leading part becomes free segment of its own.
+ */
+void *mm_malloc_align_arena(size_t size, size_t align)
+{
+	size_t gap;
+	void *ptr;
+	PNODE now, new;
+
+	if(align <= ALIGNMENT)
+	{
+		return mm_malloc_arena(size);
+	}
+	if((ptr = mm_malloc_arena(size + align + MM_NODE_SIZE)) == NULL)
+	{
+		return NULL;
+	}
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+
+	// leading part must be big enough to be a segment
+	if(((uintptr_t)ptr & (align - 1)) != 0)
+	{
+		gap = (((uintptr_t)ptr + MM_NODE_SIZE + align - 1) & ~(align - 1)) - (uintptr_t)ptr;
+
+		// set aligned segment's header
+		new = (PNODE)(ptr + gap - MM_HEADER_SIZE);
+		mm_clear_header(new);
+		new->size = now->size - (gap >> MM_ALIGN);
+		new->alloc = MM_ALLOC_ALLOC;
+		new->prev = mm_ref(now);
+		mm_get_next(new)->prev = mm_ref(new);
+
+		// free leading part
+		now->size = gap >> MM_ALIGN;
+		mm_free_arena(ptr);
+		now = new;
+	}
+
+	// split if too big; segment must stay big enough to be a node when it's freed
+	size = ALIGN(size + MM_HEADER_SIZE) >> MM_ALIGN;
+	now = mm_frag_node(now, size < MM_SMALL_MIN ? MM_SMALL_MIN : size);
+	return (void *)now + MM_HEADER_SIZE;
+}
+
+#if MM_ARENA
+/* 
+ * mm_arena_lock
+ * Locks arena and frees segments pushed by other threads.
+ */
+void mm_arena_lock(PDATA data)
+{
+	PNODE list, next;
+
+	pthread_mutex_lock(&data->lock);
+
+	if(data->remote != NULL)
+	{
+		// take whole stack at once
+		list = __sync_lock_test_and_set(&data->remote, NULL);
+		for(; list != NULL; list = next)
+		{
+			next = MM_LEFT(list);
+			mm_free_arena((void *)list + MM_HEADER_SIZE);
+		}
+	}
+}
+#endif
+
+#if MM_TCACHE
+/* 
+ * mm_tcache_fold
+ * Adds hit and miss counts of calling thread to totals.
+ */
+void mm_tcache_fold()
+{
+	struct MM_Arenas *arenas;
+
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	__sync_fetch_and_add(&arenas->hits, mm_tcache.hits);
+	__sync_fetch_and_add(&arenas->misses, mm_tcache.misses);
+	mm_tcache.hits = mm_tcache.misses = 0;
+}
+
+/* 
+ * mm_tcache_flush
+ * Frees n segments of bin under lock of arena. Segment of other arena is pushed to its owner. Nothing is freed if no arena can be bound.
+ */
+void mm_tcache_flush(int i, int n)
+{
+	PNODE ptr;
+	PDATA data, owner;
+
+	if((data = mm_arena_current()) == NULL)
 	{
-		now->right = mm_delete_node(now->right, del, balance, NULL);
-		if(!*balance)
+		return;
+	}
+	mm_arena_lock(data);
+	for(; n > 0 && (ptr = mm_tcache.bin[i]) != NULL; n--)
+	{
+		mm_tcache.bin[i] = MM_LEFT(ptr);
+		mm_tcache.count[i]--;
+
+		owner = mm_arena_owner(ptr);
+		if(owner == data)
 		{
-			return mm_delete_right(now, balance);
+			mm_free_arena((void *)ptr + MM_HEADER_SIZE);
+		}
+		else
+		{
+			mm_arena_remote(owner, ptr);
 		}
 	}
-	return now;
+	pthread_mutex_unlock(&data->lock);
 }
 
 /* 
- * mm_search
- * Search wrapper function
+ * mm_tcache_exit
+ * Destructor of thread; returns every cached segment.
  */
-PNODE mm_search(size_t size)
+void mm_tcache_exit(void *arg)
 {
-	PDATA data;
+	int i;
 
-	// get data field
-	data = (PDATA)mem_heap_lo();
-	//search least node bigger than size
-	return mm_search_node(data->root, size);
+	if(mm_tcache.epoch != mm_epoch)
+	{
+		return;
+	}
+	for(i = 0; i < MM_SMALL_COUNT; i++)
+	{
+		mm_tcache_flush(i, mm_tcache.count[i]);
+	}
+	mm_tcache_fold();
 }
 
 /* 
- * mm_search
- * Insert wrapper function
+ * mm_tcache_key_init
+ * Creates key whose destructor flushes cache at thread exit.
  */
-void mm_insert(PNODE new)
+void mm_tcache_key_init()
 {
-	PDATA data;
+	pthread_key_create(&mm_tcache_key, mm_tcache_exit);
+}
 
-	// get data field
-	data = (PDATA)mem_heap_lo();
-	// insert node into red-black tree
-	data->root = mm_insert_node(data->root, new);
-	// set root black in case of rotation on root node
-	data->root->color = MM_COLOR_BLACK;
+/* 
+ * mm_tcache_current
+ * Get cache of calling thread. Cache is emptied if heap has been reinitialized since it was used.
+ */
+struct MM_Tcache *mm_tcache_current()
+{
+	if(mm_tcache.epoch != mm_epoch)
+	{
+		memset(&mm_tcache, 0, sizeof(mm_tcache));
+		mm_tcache.epoch = mm_epoch;
+		pthread_once(&mm_tcache_once, mm_tcache_key_init);
+		pthread_setspecific(mm_tcache_key, &mm_tcache);
+	}
+	return &mm_tcache;
 }
 
 /* 
- * mm_search
- * Delete wrapper function
+ * mm_tcache_malloc
+ * Pops segment from cache without lock. On miss, bin is refilled with MM_TCACHE_BATCH segments under lock of arena. Returns NULL if size isn't small or arena is exhausted.
  */
-void mm_delete(PNODE del)
+void *mm_tcache_malloc(size_t size)
 {
-	char balance;
+	int i, n;
+	void *ptr;
+	PNODE now;
 	PDATA data;
+	struct MM_Tcache *tcache;
 
-	// get data field
-	data = (PDATA)mem_heap_lo();
-	// delete node; del should exists in tree
-	data->root = mm_delete_node(data->root, del, &balance, NULL);
-	// set root black in case of rotation on root node
-	data->root->color = MM_COLOR_BLACK;
+	// convert size
+	size = ALIGN(size + MM_HEADER_SIZE) >> MM_ALIGN;
+	if(size < MM_SMALL_MIN || size > MM_SMALL_MAX)
+	{
+		return NULL;
+	}
+	i = size - MM_SMALL_MIN;
+
+	tcache = mm_tcache_current();
+	if((now = tcache->bin[i]) != NULL)
+	{
+		tcache->bin[i] = MM_LEFT(now);
+		tcache->count[i]--;
+		tcache->hits++;
+		return (void *)now + MM_HEADER_SIZE;
+	}
+
+	tcache->misses++;
+	mm_tcache_fold();
+
+	if((data = mm_arena_current()) == NULL)
+	{
+		return NULL;
+	}
+
+	// refill bin in batch
+	mm_arena_lock(data);
+	ptr = mm_malloc_arena((size << MM_ALIGN) - MM_HEADER_SIZE);
+	for(n = 1; ptr != NULL && n < MM_TCACHE_BATCH; n++)
+	{
+		if((now = mm_malloc_arena((size << MM_ALIGN) - MM_HEADER_SIZE)) == NULL)
+		{
+			break;
+		}
+		now = (PNODE)((void *)now - MM_HEADER_SIZE);
+		now->left = mm_ref(tcache->bin[i]);
+		tcache->bin[i] = now;
+		tcache->count[i]++;
+	}
+	pthread_mutex_unlock(&data->lock);
+
+	return ptr;
 }
 
 /* 
- * mm_get_prev
- * Get previous segment using previous segment's footer.
+ * mm_tcache_push
+ * Pushes segment into bin i of cache without lock. If bin is full, MM_TCACHE_BATCH segments are flushed first.
  */
-PNODE mm_get_prev(PNODE ptr)
+void mm_tcache_push(PNODE now, int i)
 {
-	// actually it's footer of previous segment
-	return ptr->prev;
+	struct MM_Tcache *tcache;
+
+	tcache = mm_tcache_current();
+	if(tcache->count[i] >= MM_TCACHE_MAX)
+	{
+		mm_tcache_flush(i, MM_TCACHE_BATCH);
+	}
+
+	now->left = mm_ref(tcache->bin[i]);
+	tcache->bin[i] = now;
+	tcache->count[i]++;
 }
 
 /* 
- * mm_get_next
- * Get next segment using current segment's size field.
+ * mm_tcache_free
+ * Pushes small segment into cache of its size. Returns 0 if segment isn't small.
  */
-PNODE mm_get_next(PNODE ptr)
+int mm_tcache_free(void *ptr)
+{
+	PNODE now;
+
+	// convert pointer
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+	if(now->size < MM_SMALL_MIN || now->size > MM_SMALL_MAX)
+	{
+		return 0;
+	}
+	mm_tcache_push(now, now->size - MM_SMALL_MIN);
+	return 1;
+}
+#endif
+
+/* 
+ * mm_tcache_stats
+ * Get hit and miss counts of per-thread cache. Counts of other threads are included up to their last miss. Both are 0 without MM_TCACHE.
+ */
+void mm_tcache_stats(unsigned long *hits, unsigned long *misses)
+{
+#if MM_TCACHE
+	struct MM_Arenas *arenas;
+
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	*hits = arenas->hits + (mm_tcache.epoch == mm_epoch ? mm_tcache.hits : 0);
+	*misses = arenas->misses + (mm_tcache.epoch == mm_epoch ? mm_tcache.misses : 0);
+#else
+	*hits = *misses = 0;
+#endif
+}
+
+/* 
+ * mm_mapped_counter
+ * Get counter of bytes in mappings of huge segments. It's in data field, or in header of arenas in arena mode.
+ */
+size_t *mm_mapped_counter()
+{
+#if MM_ARENA
+	return &((struct MM_Arenas *)mem_heap_lo())->mapped;
+#else
+	return &((PDATA)mem_heap_lo())->mapped;
+#endif
+}
+
+/* 
+ * mm_map_list
+ * Get head of list of mappings of huge segments. It's in data field, or in header of arenas in arena mode.
+ */
+struct MM_Map **mm_map_list()
+{
+#if MM_ARENA
+	return &((struct MM_Arenas *)mem_heap_lo())->maps;
+#else
+	return &((PDATA)mem_heap_lo())->maps;
+#endif
+}
+
+/* 
+ * mm_map_lock
+ * Lock list of mappings. In arena mode, it's under lock of arenas; else nothing is needed.
+ */
+void mm_map_lock()
+{
+#if MM_ARENA
+	pthread_mutex_lock(&((struct MM_Arenas *)mem_heap_lo())->lock);
+#endif
+}
+
+/* 
+ * mm_map_unlock
+ * Unlock list of mappings.
+ */
+void mm_map_unlock()
+{
+#if MM_ARENA
+	pthread_mutex_unlock(&((struct MM_Arenas *)mem_heap_lo())->lock);
+#endif
+}
+
+/* 
+ * mm_mapped_range
+ * Returns 1 if bytes from lo to hi lie in payload of one mapping of huge segment. Only list of mappings is searched, so pointer that mm.c didn't return is never read.
+ */
+int mm_mapped_range(void *lo, void *hi)
+{
+	int found;
+	struct MM_Map *map;
+	PNODE now;
+
+	found = 0;
+	mm_map_lock();
+	for(map = *mm_map_list(); map != NULL && !found; map = map->next)
+	{
+		now = (PNODE)((void *)map + MM_MAP_PAD);
+		found = lo >= (void *)now + MM_HEADER_SIZE && hi < (void *)now + ((size_t)now->size << MM_ALIGN);
+	}
+	mm_map_unlock();
+	return found;
+}
+
+/* 
+ * mm_is_mapped
+ * Returns 1 if segment is in its own mapping instead of heap. Such segment is tagged with null bit and clear alloc bit. In heap, null bit is also set for sentinel node and deferred segments, but deferred segments keep alloc bit, and sentinel node is never handed out.
+ */
+int mm_is_mapped(void *ptr)
+{
+	PNODE now;
+
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+	return now->null == MM_NULL_NULL && now->alloc == MM_ALLOC_FREE;
+}
+
+/* 
+ * mm_mapped_bytes
+ * Get total size of mappings of huge segments.
+ */
+size_t mm_mapped_bytes()
+{
+	return *mm_mapped_counter();
+}
+
+#if MM_MMAP
+/* 
+ * mm_map_link
+ * Push mapping into list of mappings.
+ */
+void mm_map_link(struct MM_Map *map)
+{
+	struct MM_Map **head;
+
+	mm_map_lock();
+	head = mm_map_list();
+	map->prev = NULL;
+	map->next = *head;
+	if(*head != NULL)
+	{
+		(*head)->prev = map;
+	}
+	*head = map;
+	mm_map_unlock();
+}
+
+/* 
+ * mm_map_unlink
+ * Take mapping out of list of mappings.
+ */
+void mm_map_unlink(struct MM_Map *map)
+{
+	mm_map_lock();
+	if(map->prev != NULL)
+	{
+		map->prev->next = map->next;
+	}
+	else
+	{
+		*mm_map_list() = map->next;
+	}
+	if(map->next != NULL)
+	{
+		map->next->prev = map->prev;
+	}
+	mm_map_unlock();
+}
+
+/* 
+ * mm_map_size
+ * Get size of mapping for segment of given size.
+ */
+size_t mm_map_size(size_t size)
+{
+	return (size + MM_MAP_PAD + MM_HEADER_SIZE + mem_pagesize() - 1) & ~(mem_pagesize() - 1);
+}
+
+/* 
+ * mm_map
+ * Allocates huge segment in its own mapping. Mapping begins with its links, and header follows after MM_MAP_PAD; size field has size of mapping without pad.
+ */
+void *mm_map(size_t size)
+{
+	size_t len;
+	PNODE ptr;
+
+	len = mm_map_size(size);
+	if(len > MM_SIZE_MAX)
+	{
+		return NULL;
+	}
+	ptr = (PNODE)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ptr == MAP_FAILED)
+	{
+		return NULL;
+	}
+	mm_map_link((struct MM_Map *)ptr);
+	ptr = (PNODE)((void *)ptr + MM_MAP_PAD);
+
+	// set header with tag; alloc bit stays clear, so it isn't taken for deferred segment
+	mm_clear_header(ptr);
+	ptr->size = (len - MM_MAP_PAD) >> MM_ALIGN;
+	ptr->null = MM_NULL_NULL;
+
+	__sync_fetch_and_add(mm_mapped_counter(), len);
+	return (void *)ptr + MM_HEADER_SIZE;
+}
+
+/* 
+ * mm_unmap
+ * Frees huge segment by unmapping it.
+ */
+void mm_unmap(PNODE now)
+{
+	size_t len;
+
+	len = ((size_t)now->size << MM_ALIGN) + MM_MAP_PAD;
+	__sync_fetch_and_sub(mm_mapped_counter(), len);
+	mm_map_unlink((struct MM_Map *)((void *)now - MM_MAP_PAD));
+	munmap((void *)now - MM_MAP_PAD, len);
+}
+
+/* 
+ * mm_remap
+ * Reallocates huge segment. If it stays huge, mapping is resized by mremap() so payload is never copied. Else, it moves into heap.
+ */
+void *mm_remap(void *ptr, size_t size)
+{
+	size_t osize, olen, len;
+	void *new;
+	PNODE now;
+
+	now = (PNODE)(ptr - MM_HEADER_SIZE);
+
+	if(mm_is_mapped(ptr) && size >= MM_MMAP_THRESHOLD)
+	{
+		len = mm_map_size(size);
+		if(len > MM_SIZE_MAX)
+		{
+			return NULL;
+		}
+		olen = ((size_t)now->size << MM_ALIGN) + MM_MAP_PAD;
+		if(len == olen)
+		{
+			return ptr;
+		}
+		// mapping may move, so it's linked again wherever it ends up
+		mm_map_unlink((struct MM_Map *)((void *)now - MM_MAP_PAD));
+		new = mremap((void *)now - MM_MAP_PAD, olen, len, MREMAP_MAYMOVE);
+		if(new == MAP_FAILED)
+		{
+			mm_map_link((struct MM_Map *)((void *)now - MM_MAP_PAD));
+			return NULL;
+		}
+		mm_map_link((struct MM_Map *)new);
+		__sync_fetch_and_add(mm_mapped_counter(), len - olen);
+		new += MM_MAP_PAD;
+		((PNODE)new)->size = (len - MM_MAP_PAD) >> MM_ALIGN;
+		return new + MM_HEADER_SIZE;
+	}
+
+	// move between heap and mapping
+	if((new = mm_malloc(size)) == NULL)
+	{
+		return NULL;
+	}
+	osize = ((size_t)now->size << MM_ALIGN) - MM_HEADER_SIZE;
+	mm_memcpy(new, ptr, osize < size ? osize : size);
+	mm_free(ptr);
+	return new;
+}
+#endif
+
+/* 
+ * mm_set_deferred
+ * Turns deferred coalescing on or off. Segments already deferred are swept as usual. Returns previous mode.
+ */
+int mm_set_deferred(int on)
+{
+	int old;
+
+	old = mm_deferred;
+	mm_deferred = on;
+	return old;
+}
+
+/* 
+ * mm_thread_safe
+ * Returns 1 if mm_malloc, mm_free and mm_realloc can be called from multiple threads at once.
+ */
+int mm_thread_safe()
+{
+	return MM_ARENA;
+}
+
+#if MM_ARENA
+/*
+ * mm_unlock_from
+ * Releases lock of arenas, every arena lock and locks of caches in list from given one, in reverse order of mm_lock_all.
+ */
+void mm_unlock_from(struct MM_Arenas *arenas, struct MM_Cache *cache)
+{
+	int i;
+
+	pthread_mutex_unlock(&arenas->lock);
+	for(i = 0; i < arenas->count; i++)
+	{
+		pthread_mutex_unlock(&arenas->arena[i]->lock);
+	}
+	for(; cache != NULL; cache = cache->next)
+	{
+		pthread_mutex_unlock(&cache->lock);
+	}
+}
+#endif
+
+/*
+ * mm_lock_all
+ * Takes every lock of heap, so fork() can't copy heap while other thread is changing it. Locks of slab caches are taken first, since mm_slab_alloc takes arena locks under them; arena locks are taken before lock of arenas, which is the order mm_heap_sbrk takes them. It retries if arena is carved meanwhile, and starts over if cache is created meanwhile.
+ */
+void mm_lock_all()
+{
+#if MM_ARENA
+	int i, n;
+	struct MM_Cache *caches, *cache;
+	struct MM_Arenas *arenas;
+
+	if(mm_base == NULL)
+	{
+		return;
+	}
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	for(;;)
+	{
+		caches = __atomic_load_n(&arenas->caches, __ATOMIC_ACQUIRE);
+		for(cache = caches; cache != NULL; cache = cache->next)
+		{
+			pthread_mutex_lock(&cache->lock);
+		}
+		for(i = 0; ; )
+		{
+			for(n = arenas->count; i < n; i++)
+			{
+				pthread_mutex_lock(&arenas->arena[i]->lock);
+			}
+			pthread_mutex_lock(&arenas->lock);
+			if(arenas->count == n)
+			{
+				break;
+			}
+			pthread_mutex_unlock(&arenas->lock);
+		}
+		// lock of new cache can't be taken under arena locks
+		if(arenas->caches == caches)
+		{
+			break;
+		}
+		mm_unlock_from(arenas, caches);
+	}
+#endif
+}
+
+/*
+ * mm_unlock_all
+ * Releases locks taken by mm_lock_all, in both parent and child after fork().
+ */
+void mm_unlock_all()
 {
-	// calculate next segment with size
-	return (PNODE)(((void *)ptr) + (ptr->size << MM_ALIGN));
+#if MM_ARENA
+	struct MM_Arenas *arenas;
+
+	if(mm_base == NULL)
+	{
+		return;
+	}
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	mm_unlock_from(arenas, arenas->caches);
+#endif
 }
 
-/* 
- * mm_clear_header
- * Clear header of segment. Only clears linked-list header, not red-black tree node information.
+/*
+ * mm_usable_size
+ * Get number of bytes usable in payload of allocated segment, which may be more than requested.
  */
-void mm_clear_header(void *ptr)
+size_t mm_usable_size(void *ptr)
 {
-	// by constant definition, set all bits 0 works
-	mm_memset(ptr, 0, MM_HEADER_SIZE);
+	return ((size_t)((PNODE)(ptr - MM_HEADER_SIZE))->size << MM_ALIGN) - MM_HEADER_SIZE;
 }
 
 /* 
- * mm_frag_node
- * Break free segment into two segments. First one is for allocation, second one is inserted into red-black tree.
+ * mm_malloc
+ * Allocates in arena of calling thread.
  */
-void *mm_frag_node(PNODE now, size_t size)
+void *mm_malloc(size_t size)
 {
-	size_t tsize;
-	PNODE next;
+#if MM_ARENA
+	void *ptr;
+	PDATA data;
+#endif
 
-	// if given segment is too small to fragment, just return
-	if(now->size < size + (MM_NODE_SIZE >> MM_ALIGN))
+	// size field can't describe bigger segment
+	if(size > MM_SIZE_MAX - MM_HEADER_SIZE)
 	{
-		mm_get_next(now)->prev = now;
-		return now;
+		return NULL;
 	}
 
-	tsize = now->size - size;
-	now->size = size;
-
-	// set second segment's header
-	next = mm_get_next(now);
-	mm_clear_header(next);
-	next->size = tsize;
+#if MM_MMAP
+	if(size >= MM_MMAP_THRESHOLD)
+	{
+		return mm_map(size);
+	}
+#endif
 
-	// set list pointers
-	next->prev = now;
-	mm_get_next(next)->prev = next;
-	
-	// insert second node into red-black tree
-	next->alloc = MM_ALLOC_FREE;
-	mm_insert(next);
+#if MM_ARENA
+#if MM_TCACHE
+	if((ptr = mm_tcache_malloc(size)) != NULL)
+	{
+		return ptr;
+	}
+#endif
 
-	// re-allocation doesn't occur
-	return now;
+	if((data = mm_arena_current()) == NULL)
+	{
+		return NULL;
+	}
+	mm_arena_lock(data);
+	ptr = mm_malloc_arena(size);
+	pthread_mutex_unlock(&data->lock);
+	return ptr;
+#else
+	return mm_malloc_arena(size);
+#endif
 }
 
 /* 
- * mm_sbrk
- * mem_sbrk wrapper function. This function is for maintaining spatial efficiency.
+ * mm_calloc
+ * Allocates zeroed array of nmemb elements of size. Returns NULL if size of array overflows.
  */
-PNODE mm_sbrk(size_t size)
+void *mm_calloc(size_t nmemb, size_t size)
 {
-	PNODE ptr;
+	void *ptr;
 
-	// if size to mem_sbrk is too small, expand it
-	if(size < MM_UNIT)
+	// size of array must fit in size_t
+	if(size != 0 && nmemb > SIZE_MAX / size)
 	{
-		ptr = (PNODE)(mem_sbrk(MM_UNIT) - MM_HEADER_SIZE);
-		ptr->size = MM_UNIT >> MM_ALIGN;
-		// clear new footer
-		mm_clear_header((void *)ptr + MM_UNIT);
-
-		// split segment
-		ptr->alloc = MM_ALLOC_ALLOC;
-		ptr = mm_frag_node(ptr, (size + MM_HEADER_SIZE) >> MM_ALIGN);
+		return NULL;
 	}
-	else
+	if((ptr = mm_malloc(nmemb * size)) == NULL)
 	{
-		ptr = (PNODE)(mem_sbrk(size) - MM_HEADER_SIZE);
-		ptr->size = size >> MM_ALIGN;
-		// clear new footer
-		mm_clear_header((void *)ptr + size);
-
-		// set new footer
-		ptr->alloc = MM_ALLOC_ALLOC;
-		mm_get_next(ptr)->prev = ptr;
+		return NULL;
 	}
 
-	// return new segment has size of size
+#if MM_MMAP
+	// fresh mapping is zero already
+	if(mm_is_mapped(ptr))
+	{
+		return ptr;
+	}
+#endif
+	mm_memset(ptr, 0, nmemb * size);
 	return ptr;
 }
 
 /* 
- * mm_check_node
- * Tours nodes in red-black tree. Recursively implemented.
+ * mm_free_heap
+ * Frees segment of heap in arena of calling thread. Segment of other arena is pushed to its owner without locking.
  */
-int mm_check_node(PNODE now, int *cnt)
+void mm_free_heap(void *ptr)
 {
-	if(now->null == MM_NULL_NULL)
+#if MM_ARENA
+	PDATA data, owner;
+
+	owner = mm_arena_owner(ptr);
+	if((data = mm_arena_current()) != owner)
 	{
-		return 1;
+		mm_arena_remote(owner, (PNODE)(ptr - MM_HEADER_SIZE));
+		return;
 	}
+	mm_arena_lock(data);
+	mm_free_arena(ptr);
+	pthread_mutex_unlock(&data->lock);
+#else
+	mm_free_arena(ptr);
+#endif
+}
 
-	(*cnt)++;
+/* 
+ * mm_free
+ * Frees segment, finding out from its header if it's mapped or small enough for cache.
+ */
+void mm_free(void *ptr)
+{
+#if MM_MMAP
+	if(mm_is_mapped(ptr))
+	{
+		mm_unmap((PNODE)(ptr - MM_HEADER_SIZE));
+		return;
+	}
+#endif
 
-	// check if it's valid binary search tree
-	if(now->left->null == MM_NULL_NOTNULL && mm_cmp_node(now, now->left))
+#if MM_TCACHE
+	if(mm_tcache_free(ptr))
 	{
-		mm_print_error("RBTree Broken!\n");
-		return 0;
+		return;
 	}
-	if(now->right->null == MM_NULL_NOTNULL && mm_cmp_node(now->right, now))
+#endif
+
+	mm_free_heap(ptr);
+}
+
+/* 
+ * mm_free_sized
+ * Frees segment whose size last requested by mm_malloc, mm_calloc, mm_realloc or mm_memalign is given. Size tells which bin of cache it goes to, so header of small segment isn't decoded; huge one is unmapped only if its header is tagged as mapped.
+ */
+void mm_free_sized(void *ptr, size_t size)
+{
+#if MM_MMAP
+	// only requests of MM_MMAP_THRESHOLD or more are mapped, but huge segment of mm_memalign lives in heap, so tag in header decides
+	if(size >= MM_MMAP_THRESHOLD && mm_is_mapped(ptr))
 	{
-		mm_print_error("RBTree Broken!\n");
-		return 0;
+		mm_unmap((PNODE)(ptr - MM_HEADER_SIZE));
+		return;
 	}
+#endif
 
-	// check if it's valid red-black tree
-	if(now->color == MM_COLOR_RED && (now->left->color == MM_COLOR_RED || now->right->color == MM_COLOR_RED))
+#if MM_TCACHE
+	// same conversion as mm_malloc_arena; segment might be bigger than its bin, which is harmless
+	size = ALIGN(size + MM_HEADER_SIZE) >> MM_ALIGN;
+	if(size < MM_SMALL_MIN)
 	{
-		mm_print_error("RBTree Broken!\n");
-		return 0;
+		size = MM_SMALL_MIN;
+	}
+	if(size <= MM_SMALL_MAX)
+	{
+		mm_tcache_push((PNODE)(ptr - MM_HEADER_SIZE), size - MM_SMALL_MIN);
+		return;
 	}
+#endif
 
-	return mm_check_node(now->left, cnt) & mm_check_node(now->right, cnt);
+	mm_free_heap(ptr);
 }
 
 /* 
- * mm_check
- * First checks heap sequently if any exception occured. Adjacent free segment is okay; they are part of strategies. Second it checks red-black tree.
+ * mm_realloc
+ * Reallocates in arena of calling thread. Segment of other arena is moved into arena of calling thread.
  */
-int mm_check()
+void *mm_realloc(void *ptr, size_t size)
 {
-	int nfree, nnode;
-	PNODE now;
+#if MM_ARENA
+	size_t osize;
+	void *new;
 	PDATA data;
+#endif
 
-	// get data field
-	data = (PDATA)mem_heap_lo();
+	// size field can't describe bigger segment
+	if(size > MM_SIZE_MAX - MM_HEADER_SIZE)
+	{
+		return NULL;
+	}
 
-	// count free nodes
-	nfree = nnode = 0;
-	// begin from first node, tour all nodes sequently.
-	for(now = (PNODE)((void *)data + MM_DATA_SIZE); now->size != 0; now = mm_get_next(now))
+#if MM_MMAP
+	if(ptr != NULL && size != 0 && (mm_is_mapped(ptr) || size >= MM_MMAP_THRESHOLD))
 	{
-		// check if it's valid double-linked list
-		if(mm_get_next(now)->prev != now)
-		{
-			mm_print_error("Linked List Broken!\n");
-			return 0;
-		}
-		// count free nodes
-		if(now->alloc == MM_ALLOC_FREE)
-		{
-			nfree++;
-		}
+		return mm_remap(ptr, size);
 	}
+#endif
 
-	// check red-black tree
-	if(mm_check_node(data->root, &nnode) == 0)
+#if MM_ARENA
+	// handle exceptions
+	if(ptr != NULL && size == 0)
 	{
-		return 0;
+		mm_free(ptr);
+		return ptr;
+	}
+	if((data = mm_arena_current()) == NULL)
+	{
+		return NULL;
 	}
 
-	// check counts
-	if(nfree != nnode)
+	if(ptr == NULL || data == mm_arena_owner(ptr))
 	{
-		mm_print_error("List and RBTree doesn't match!\n");
-		return 0;
+		mm_arena_lock(data);
+		new = mm_realloc_arena(ptr, size);
+		pthread_mutex_unlock(&data->lock);
+		return new;
 	}
 
-	return 1;
+	// move segment of other arena
+	if((new = mm_malloc(size)) == NULL)
+	{
+		return NULL;
+	}
+	osize = ((size_t)((PNODE)(ptr - MM_HEADER_SIZE))->size << MM_ALIGN) - MM_HEADER_SIZE;
+	mm_memcpy(new, ptr, osize < size ? osize : size);
+	mm_free(ptr);
+	return new;
+#else
+	return mm_realloc_arena(ptr, size);
+#endif
 }
 
 /* 
- * mm_init
- * Allocates heap for data and node header.
+ * mm_malloc_align
+ * Allocates with payload aligned to align in arena of calling thread. Huge segment isn't mapped on its own, since mapping is aligned to page only.
  */
-int mm_init()
+void *mm_malloc_align(size_t size, size_t align)
 {
+#if MM_ARENA
+	void *ptr;
 	PDATA data;
+#endif
 
-	// allocate data
-	data = (PDATA)mem_sbrk(MM_DATA_SIZE);
-	memset(data, 0, MM_DATA_SIZE);
-
-	// init data
-	data->root = &data->null;
-	data->null.color = MM_COLOR_BLACK;
-	data->null.null = MM_NULL_NULL;
+	// size field can't describe bigger segment; align is checked first so subtraction can't wrap
+	if(align > MM_SIZE_MAX - MM_HEADER_SIZE - MM_NODE_SIZE || size > MM_SIZE_MAX - MM_HEADER_SIZE - MM_NODE_SIZE - align)
+	{
+		return NULL;
+	}
 
-	// clear new header
-	mm_clear_header(mem_sbrk(MM_HEADER_SIZE));
+#if MM_ARENA
+	if((data = mm_arena_current()) == NULL)
+	{
+		return NULL;
+	}
+	mm_arena_lock(data);
+	ptr = mm_malloc_align_arena(size, align);
+	pthread_mutex_unlock(&data->lock);
+	return ptr;
+#else
+	return mm_malloc_align_arena(size, align);
+#endif
+}
 
-	return 0;
+/* 
+ * mm_memalign
+ * Allocates with payload aligned to align, which must be power of 2. Leading slack of segment goes back to red-black tree as free segment, so only less than align plus a node is taken temporarily. Returns NULL if align isn't power of 2.
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+	if(align == 0 || (align & (align - 1)) != 0)
+	{
+		return NULL;
+	}
+	// every segment is aligned to ALIGNMENT already
+	if(align <= ALIGNMENT)
+	{
+		return mm_malloc(size);
+	}
+	return mm_malloc_align(size, align);
 }
 
 /* 
- * mm_malloc
- * First searches in red-black tree, which keyed with segment's size. If there is free segment bigger than requested size, program returns it's pointer. Else, program calls mem_sbrk() and returns it.
+ * mm_slab_create
+ * Creates slab cache of objects of given size. Returns NULL if heap is full.
  */
-void *mm_malloc(size_t size)
+struct MM_Cache *mm_slab_create(size_t size)
 {
-	PNODE ptr;
+	struct MM_Cache *cache;
+#if MM_ARENA
+	struct MM_Arenas *arenas;
+#endif
 
-	// convert size
-	size = (ALIGN(size) + MM_HEADER_SIZE) >> MM_ALIGN;
-	// search if free segment available
-	ptr = mm_search(size);
+	if((cache = (struct MM_Cache *)mm_malloc(sizeof(struct MM_Cache))) == NULL)
+	{
+		return NULL;
+	}
+	// type is never aligned beyond its size, so smaller objects don't need ALIGNMENT
+	cache->size = size != 0 ? (size + MM_SLAB_ALIGN - 1) & ~(size_t)(MM_SLAB_ALIGN - 1) : MM_SLAB_ALIGN;
+	cache->count = (MM_SLAB_PAYLOAD - ALIGN(sizeof(struct MM_Slab))) / cache->size;
+	cache->partial = NULL;
+#if MM_ARENA
+	pthread_mutex_init(&cache->lock, NULL);
 
-	// there's no segment bigger than size
-	if(ptr == NULL)
+	// publish cache to mm_lock_all, which reads list without lock
+	arenas = (struct MM_Arenas *)mem_heap_lo();
+	pthread_mutex_lock(&arenas->lock);
+	cache->next = arenas->caches;
+	__atomic_store_n(&arenas->caches, cache, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&arenas->lock);
+#endif
+	return cache;
+}
+
+/* 
+ * mm_slab_link
+ * Push slab into list of slabs with free objects.
+ */
+void mm_slab_link(struct MM_Cache *cache, PSLAB slab)
+{
+	slab->next = mm_ref((PNODE)cache->partial);
+	slab->prev = 0;
+	if(cache->partial != NULL)
 	{
-		// newly allocate
-		ptr = mm_sbrk(size << MM_ALIGN);
+		cache->partial->prev = mm_ref((PNODE)slab);
+	}
+	cache->partial = slab;
+}
+
+/* 
+ * mm_slab_unlink
+ * Unlink slab from list of slabs with free objects.
+ */
+void mm_slab_unlink(struct MM_Cache *cache, PSLAB slab)
+{
+	if(slab->prev != 0)
+	{
+		((PSLAB)mm_node(slab->prev))->next = slab->next;
 	}
-	// segment found
 	else
 	{
-		// delete from red-black tree
-		mm_delete(ptr);
-		// split if too big
-		ptr = mm_frag_node(ptr, size);
-		// set alloc bit
-		ptr->alloc = MM_ALLOC_ALLOC;
+		cache->partial = (PSLAB)mm_node(slab->next);
+	}
+	if(slab->next != 0)
+	{
+		((PSLAB)mm_node(slab->next))->prev = slab->prev;
 	}
-
-	return (void *)ptr + MM_HEADER_SIZE;
 }
 
 /* 
- * mm_free
- * Looks previous and next segments if they are free os they can coalesced. Resulting segment is inserted into red-black tree.
+ * mm_slab_grow
+ * Allocates new slab aligned to MM_SLAB_SIZE and pushes it into list of slabs with free objects. Every object is free.
  */
-void mm_free(void *ptr)
+PSLAB mm_slab_grow(struct MM_Cache *cache)
 {
-	PNODE now, prev, next;
-
-	// convert pointer
-	now = (PNODE)(ptr - MM_HEADER_SIZE);
-	// get previous and next segment
-	prev = mm_get_prev(now);
-	next = mm_get_next(now);
+	unsigned int i;
+	PSLAB slab;
 
-	// if previous segment is free
-	if(prev != NULL && prev->alloc == MM_ALLOC_FREE)
+	if((slab = (PSLAB)mm_malloc_align(MM_SLAB_PAYLOAD, MM_SLAB_SIZE)) == NULL)
 	{
-		// delete segment and coalesce
-		mm_delete(prev);
-		prev->size += now->size;
-		now = prev;
+		return NULL;
 	}
-	// if next segment is free
-	if(next->size != 0 && next->alloc == MM_ALLOC_FREE)
+	memset(slab, 0, sizeof(struct MM_Slab));
+	slab->cache = mm_ref((PNODE)cache);
+	for(i = 0; i < cache->count; i++)
 	{
-		// delete segment and coalesce
-		mm_delete(next);
-		now->size += next->size;
+		slab->map[i >> 5] |= 1u << (i & 31);
 	}
-
-	// set alloc bit
-	now->alloc = MM_ALLOC_FREE;
-	// insert into list
-	mm_get_next(now)->prev = now;
-	// insert into red-black tree
-	mm_insert(now);
+	mm_slab_link(cache, slab);
+	return slab;
 }
 
 /* 
- * mm_realloc
- * There are three cases: segment shrinks, expands, re-alloceted. Requested segment is expanded when following segment is available.
+ * mm_slab_alloc
+ * Allocates object from slab cache. First free object of first slab with free objects is taken; new slab is allocated if there's no such slab.
  */
-void *mm_realloc(void *ptr, size_t size)
+void *mm_slab_alloc(struct MM_Cache *cache)
 {
-	size_t osize, sum;
-	PNODE now, next, new;
+	unsigned int i, j;
+	PSLAB slab;
 
-	// handle exceptions
-	if(ptr == NULL)
+	if(cache->size > MM_SLAB_OBJ_MAX)
 	{
-		return mm_malloc(size);
+		return mm_malloc(cache->size);
 	}
-	if(size == 0)
+
+#if MM_ARENA
+	pthread_mutex_lock(&cache->lock);
+#endif
+	if((slab = cache->partial) == NULL && (slab = mm_slab_grow(cache)) == NULL)
 	{
-		mm_free(ptr);
-		return ptr;
+#if MM_ARENA
+		pthread_mutex_unlock(&cache->lock);
+#endif
+		return NULL;
 	}
 
-	// convert size
-	osize = size;
-	size = (ALIGN(size) + MM_HEADER_SIZE) >> MM_ALIGN;
-	// convert pointer
-	now = (PNODE)(ptr - MM_HEADER_SIZE);
+	// take first free object
+	for(i = 0; slab->map[i] == 0; i++);
+	j = __builtin_ctz(slab->map[i]);
+	slab->map[i] &= ~(1u << j);
 
-	// shrink case
-	if(size <= now->size)
+	// full slab leaves list
+	if(++slab->count == cache->count)
 	{
-		// now->alloc = MM_ALLOC_ALLOC;
-		// split if too big
-		now = mm_frag_node(now, size);
+		mm_slab_unlink(cache, slab);
 	}
-	else
-	{
-		// check following segments
-		sum = now->size;
-		for(next = mm_get_next(now); next->size != 0 && next->alloc == MM_ALLOC_FREE && sum < size; next = mm_get_next(next))
-		{
-			sum += next->size;
-		}
+#if MM_ARENA
+	pthread_mutex_unlock(&cache->lock);
+#endif
 
-		// if segment is at the end of heap
-		if(sum < size && next->size == 0)
-		{
-			// newly allocate lacking memory
-			next = mm_sbrk((size - sum) << MM_ALIGN);
-			// insert into heap; this might cause temporarily uncoalesced free segments
-			next->alloc = MM_ALLOC_FREE;
-			mm_insert(next);
-		}
-		// re-allocation case; else, expand case
-		else if(sum < size)
-		{
-			// newly allocate
-			new = mm_malloc(osize);
-			// copy datas
-			mm_memcpy(new, ptr, (now->size << MM_ALIGN) - MM_HEADER_SIZE);
-			// free existing segment
-			mm_free(ptr);
-			// return new segment
-			return new;
-		}
+	return (void *)slab + ALIGN(sizeof(struct MM_Slab)) + (((i << 5) + j) * cache->size);
+}
 
-		// coalesce following free segments
-		for(next = mm_get_next(now); next->size != 0 && next->alloc == MM_ALLOC_FREE && now->size < size; next = mm_get_next(next))
-		{
-			mm_delete(next);
-			now->size += next->size;
-		}
-		// insert into list
-		mm_get_next(now)->prev = now;
+/* 
+ * mm_slab_free
+ * Frees object into its slab, which is found by masking its address. Slab which becomes empty is freed unless it's the only slab with free objects.
+ */
+void mm_slab_free(struct MM_Cache *cache, void *ptr)
+{
+	unsigned int i;
+	PSLAB slab;
+
+	if(cache->size > MM_SLAB_OBJ_MAX)
+	{
+		mm_free(ptr);
+		return;
 	}
 
-	return ptr;
+	slab = (PSLAB)((uintptr_t)ptr & ~(uintptr_t)(MM_SLAB_SIZE - 1));
+	i = (ptr - (void *)slab - ALIGN(sizeof(struct MM_Slab))) / cache->size;
+
+#if MM_ARENA
+	pthread_mutex_lock(&cache->lock);
+#endif
+	slab->map[i >> 5] |= 1u << (i & 31);
+
+	// full slab comes back to list
+	if(slab->count-- == cache->count)
+	{
+		mm_slab_link(cache, slab);
+	}
+	// empty slab goes back to red-black tree, unless it's the only one left
+	if(slab->count == 0 && (slab->prev != 0 || slab->next != 0))
+	{
+		mm_slab_unlink(cache, slab);
+		mm_free(slab);
+	}
+#if MM_ARENA
+	pthread_mutex_unlock(&cache->lock);
+#endif
 }
@@ -4,6 +4,61 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern void mm_tcache_stats(unsigned long *hits, unsigned long *misses);
+extern int mm_thread_safe(void);
+extern int mm_is_mapped(void *ptr);
+extern int mm_mapped_range(void *lo, void *hi);
+extern size_t mm_mapped_bytes(void);
+extern int mm_set_deferred(int on);
+extern void *mm_malloc_align(size_t size, size_t align);
+extern size_t mm_usable_size(void *ptr);
+extern void mm_lock_all(void);
+extern void mm_unlock_all(void);
+
+/* Shape of the heap reported by mm_get_stats; sizes are in bytes */
+#define MM_STATS_BINS 16
+struct MM_Stats {
+    size_t heap_bytes;          /* size of the heap */
+    size_t free_bytes;          /* total size of free blocks */
+    size_t free_count;          /* number of free blocks */
+    size_t largest_free;        /* size of the largest free block */
+    double frag;                /* external fragmentation, 1 - largest/free */
+    int tree_height;            /* height of the tallest free block tree */
+    int black_height;           /* greatest black height of those trees */
+    int adjacent_free;          /* adjacent free pairs not coalesced yet */
+    size_t hist[MM_STATS_BINS]; /* free blocks of [16 << i, 32 << i) bytes;
+				   the last bin takes bigger ones too */
+    unsigned long sbrk_count;   /* times the heap grew */
+    unsigned long sbrk_merged;  /* growths merged with a free top block */
+    size_t chunk;               /* how far the heap is reserved ahead */
+};
+extern void mm_get_stats(struct MM_Stats *stats);
+
+/* Slab caches of fixed-size objects */
+struct MM_Cache;
+extern struct MM_Cache *mm_slab_create(size_t size);
+extern void *mm_slab_alloc(struct MM_Cache *cache);
+extern void mm_slab_free(struct MM_Cache *cache, void *ptr);
+
+/* Copy and fill routines of mm.c, also timed by membench */
+extern void *mm_memcpy(void *dst, void *src, size_t n);
+extern void *mm_memset(void *b, int c, size_t len);
+extern void *mm_memmove(void *dst, void *src, size_t n);
+extern void *mm_memcpy_byte(void *dst, void *src, size_t n);
+extern void *mm_memset_byte(void *b, int c, size_t len);
+extern void *mm_memmove_byte(void *dst, void *src, size_t n);
+extern void *mm_memcpy_word(void *dst, void *src, size_t n);
+extern void *mm_memset_word(void *b, int c, size_t len);
+extern void *mm_memmove_word(void *dst, void *src, size_t n);
+extern void *mm_memcpy_sse2(void *dst, void *src, size_t n);
+extern void *mm_memset_sse2(void *b, int c, size_t len);
+extern void *mm_memmove_sse2(void *dst, void *src, size_t n);
+extern void *mm_memcpy_avx2(void *dst, void *src, size_t n);
+extern void *mm_memset_avx2(void *b, int c, size_t len);
+extern void *mm_memmove_avx2(void *dst, void *src, size_t n);
 
 
 /* 
@@ -0,0 +1,172 @@
+/*
+ * mmshim.c - Preloadable build of mm.c as the system allocator
+ *
+ * Replaces malloc, free, realloc, calloc, memalign, posix_memalign,
+ * aligned_alloc, valloc, pvalloc, malloc_usable_size and the C23
+ * free_sized and free_aligned_sized of any program with the routines
+ * of mm.c, so the allocator can be measured against libc on real
+ * programs:
+ *
+ *     unix> make libmm.so
+ *     unix> LD_PRELOAD=./libmm.so app
+ *
+ * mm.c is built in arena mode with per-thread caches, so it is
+ * thread-safe, and huge blocks get their own mappings. memlib models
+ * the heap with address space reserved by mmap and committed as the
+ * brk grows, which stands in for sbrk without clashing with anything
+ * else in the program that moves the real brk. Only the symbols
+ * above are exported; mm.c and memlib are hidden inside the library.
+ *
+ * mm.c is built with MM_ALIGNMENT=16, so every block is aligned to 16
+ * bytes like alignof(max_align_t) of x86-64 and glibc; memalign and
+ * friends serve anything stricter. Heap locks are held across fork(),
+ * so the child can allocate right away.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "mm.h"
+#include "memlib.h"
+
+#define EXPORT __attribute__((visibility("default")))
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+/*
+ * shim_init - Reserve the heap and initialize mm.c, once
+ */
+static void shim_init(void)
+{
+    mem_init();
+    mm_init();
+}
+
+/*
+ * shim_ctor - Initialize before main and register the fork handlers.
+ *     pthread_atfork may allocate, so it can't run inside shim_init.
+ */
+static void __attribute__((constructor)) shim_ctor(void)
+{
+    pthread_once(&init_once, shim_init);
+    pthread_atfork(mm_lock_all, mm_unlock_all, mm_unlock_all);
+}
+
+/*
+ * aligned - Allocate size bytes aligned to align, which must be a
+ *     power of 2. Returns NULL with errno set on failure.
+ */
+static void *aligned(size_t align, size_t size)
+{
+    void *p;
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    pthread_once(&init_once, shim_init);
+    if ((p = mm_memalign(align, size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+/**************************
+ * Exported allocator API
+ **************************/
+
+EXPORT void *malloc(size_t size)
+{
+    void *p;
+
+    pthread_once(&init_once, shim_init);
+    if ((p = mm_malloc(size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void free(void *ptr)
+{
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+EXPORT void free_sized(void *ptr, size_t size)
+{
+    if (ptr != NULL)
+	mm_free_sized(ptr, size);
+}
+
+EXPORT void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    /* aligned blocks may not be where their size says */
+    if (ptr != NULL)
+	mm_free(ptr);
+}
+
+EXPORT void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    pthread_once(&init_once, shim_init);
+    if ((p = mm_calloc(nmemb, size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size)
+{
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if ((p = mm_realloc(ptr, size)) == NULL)
+	errno = ENOMEM;
+    return p;
+}
+
+EXPORT void *memalign(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+EXPORT void *aligned_alloc(size_t alignment, size_t size)
+{
+    return aligned(alignment, size);
+}
+
+EXPORT int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    /* errno is left alone; the error is returned instead */
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+	return EINVAL;
+    pthread_once(&init_once, shim_init);
+    if ((p = mm_memalign(alignment, size)) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+EXPORT void *valloc(size_t size)
+{
+    return aligned(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    return aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr)
+{
+    return ptr != NULL ? mm_usable_size(ptr) : 0;
+}
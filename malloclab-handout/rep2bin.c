@@ -0,0 +1,168 @@
+/*
+ * rep2bin.c - Converts a text .rep trace into a binary trace
+ *
+ * The binary trace (see trace.h) is mapped by mdriver as it is, so
+ * big traces are loaded without parsing or copying. mdriver tells
+ * the two formats apart by the magic number, so a binary trace can
+ * be passed with -f or listed in DEFAULT_TRACEFILES like any other.
+ *
+ * usage: rep2bin <in.rep> <out>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024 /* max string size */
+
+/*
+ * convert - parse the text trace in and write it to out in binary
+ *     format. Returns 0 on success.
+ */
+static int convert(FILE *in, FILE *out, char *name)
+{
+    trace_hdr_t hdr;
+    traceop_t op;
+    char type[MAXLINE];
+    unsigned index, size, align;
+    int max_index = -1;
+    int num_ops = 0;
+    char *live;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    if (fscanf(in, "%d %d %d %d", &hdr.sugg_heapsize, &hdr.num_ids,
+	       &hdr.num_ops, &hdr.weight) != 4) {
+	fprintf(stderr, "%s: bad trace header\n", name);
+	return -1;
+    }
+
+    /* mdriver sizes its arrays by num_ids, so every id must be below it, 
+       and a block must be allocated before it is realloc'd or freed */
+    if (hdr.num_ids < 0 || (live = (char *)calloc(hdr.num_ids + 1, 1)) == NULL) {
+	fprintf(stderr, "%s: bad trace header\n", name);
+	return -1;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, out) != 1) {
+	free(live);
+	return -1;
+    }
+
+    /* Write one record per request line */
+    while (fscanf(in, "%s", type) != EOF) {
+	memset(&op, 0, sizeof(op));
+	switch (type[0]) {
+	case 'a':
+	case 'r':
+	case 'c':
+	    if (fscanf(in, "%u %u", &index, &size) != 2) {
+		fprintf(stderr, "%s: bad request %d\n", name, num_ops);
+		free(live);
+		return -1;
+	    }
+	    op.type = (type[0] == 'a') ? ALLOC : 
+		(type[0] == 'r') ? REALLOC : CALLOC;
+	    op.index = index;
+	    op.size = size;
+	    if ((int)index > max_index)
+		max_index = index;
+	    break;
+	case 'm':
+	    if (fscanf(in, "%u %u %u", &index, &align, &size) != 3 ||
+		align == 0 || (align & (align - 1)) != 0) {
+		fprintf(stderr, "%s: bad request %d\n", name, num_ops);
+		free(live);
+		return -1;
+	    }
+	    op.type = MEMALIGN;
+	    op.index = index;
+	    op.size = size;
+	    op.align = align;
+	    if ((int)index > max_index)
+		max_index = index;
+	    break;
+	case 's':
+	    if (fscanf(in, "%u %u", &index, &size) != 2) {
+		fprintf(stderr, "%s: bad request %d\n", name, num_ops);
+		free(live);
+		return -1;
+	    }
+	    op.type = FREE_SIZED;
+	    op.index = index;
+	    op.size = size;
+	    break;
+	case 'f':
+	    if (fscanf(in, "%u", &index) != 1) {
+		fprintf(stderr, "%s: bad request %d\n", name, num_ops);
+		free(live);
+		return -1;
+	    }
+	    op.type = FREE;
+	    op.index = index;
+	    break;
+	default:
+	    fprintf(stderr, "%s: bogus type character (%c)\n", name, type[0]);
+	    free(live);
+	    return -1;
+	}
+	if (index >= (unsigned)hdr.num_ids) {
+	    fprintf(stderr, "%s: id %u of request %d is not below %d ids\n", 
+		    name, index, num_ops, hdr.num_ids);
+	    free(live);
+	    return -1;
+	}
+	if (op.type == REALLOC || op.type == FREE || op.type == FREE_SIZED) {
+	    if (!live[index]) {
+		fprintf(stderr, "%s: request %d names id %u, "
+			"which is not allocated\n", name, num_ops, index);
+		free(live);
+		return -1;
+	    }
+	    live[index] = (op.type == REALLOC);
+	}
+	else
+	    live[index] = 1;
+	if (fwrite(&op, sizeof(op), 1, out) != 1) {
+	    free(live);
+	    return -1;
+	}
+	num_ops++;
+    }
+    free(live);
+
+    /* mdriver relies on the header to size its arrays */
+    if (num_ops != hdr.num_ops || max_index != hdr.num_ids - 1) {
+	fprintf(stderr, "%s: header says %d ids and %d ops, found %d and %d\n",
+		name, hdr.num_ids, hdr.num_ops, max_index + 1, num_ops);
+	return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    FILE *in, *out;
+
+    if (argc != 3) {
+	fprintf(stderr, "usage: %s <in.rep> <out>\n", argv[0]);
+	exit(1);
+    }
+    if ((in = fopen(argv[1], "r")) == NULL) {
+	fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+	fprintf(stderr, "%s: %s\n", argv[2], strerror(errno));
+	exit(1);
+    }
+    if (convert(in, out, argv[1]) < 0 || fclose(out) != 0) {
+	fprintf(stderr, "%s: conversion failed\n", argv[1]);
+	remove(argv[2]);
+	exit(1);
+    }
+    fclose(in);
+    exit(0);
+}
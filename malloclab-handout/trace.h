@@ -0,0 +1,46 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - Trace records shared by mdriver and the trace tools
+ *
+ * A binary trace is a trace_hdr_t followed by num_ops traceop_t
+ * records, in the byte order of the machine that wrote it. mdriver
+ * maps the records as they are, so loading a binary trace copies
+ * nothing. rep2bin converts a text .rep trace into this format.
+ *
+ * Request lines of a text trace:
+ *
+ *     a <id> <size>           malloc
+ *     r <id> <size>           realloc
+ *     f <id>                  free
+ *     c <id> <size>           calloc of one element of size bytes
+ *     m <id> <align> <size>   memalign; align is a power of 2
+ *     s <id> <size>           free given the size last requested; not
+ *                             for a block made by m and not realloc'd
+ */
+
+#define TRACE_MAGIC   0x5254504d /* "MPTR" in little endian */
+#define TRACE_VERSION 2
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct {
+    enum {ALLOC, FREE, REALLOC, 
+	  CALLOC, MEMALIGN, FREE_SIZED} type; /* type of request */
+    int index;                        /* index for free() to use later */
+    int size;                         /* byte size of alloc/realloc request,
+					 or of the block a sized free frees */
+    int align;                        /* alignment of memalign request */
+} traceop_t;
+
+/* Header of a binary trace file */
+typedef struct {
+    unsigned magic;      /* TRACE_MAGIC */
+    unsigned version;    /* TRACE_VERSION */
+    int sugg_heapsize;   /* suggested heap size (unused) */
+    int num_ids;         /* number of alloc/realloc ids */
+    int num_ops;         /* number of distinct requests */
+    int weight;          /* weight for this trace (unused) */
+} trace_hdr_t;
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,498 @@
+/*
+ * tracecap.c - Preloadable interposer that captures allocation traces
+ *
+ * Records malloc, calloc, realloc and free of any program into a
+ * text trace that mdriver can replay:
+ *
+ *     unix> make libtracecap.so
+ *     unix> TRACECAP_FILE=app.rep LD_PRELOAD=./libtracecap.so app
+ *     unix> mdriver -f app.rep
+ *
+ * mdriver replays it on a heap of at most MAX_HEAP of config.h, 20MB
+ * by default; programs with more live data need mdriver rebuilt with
+ * a larger one, as the README shows. Sizes are clamped to INT_MAX,
+ * the most mdriver reads.
+ *
+ * "%p" in TRACECAP_FILE is replaced by the pid, which keeps programs
+ * started by app from writing the same file; it's the default name
+ * tracecap.%p.rep too.
+ *
+ * Every block gets the next id when it's allocated, and keeps it
+ * across realloc. Ids are found by address in a hash table split
+ * into shards with a lock each. Every request also gets a global
+ * sequence number: free takes it before the block is given back,
+ * and malloc after the block is taken, so a reused address is
+ * always freed before it's allocated again in the trace.
+ *
+ * Threads buffer their records and append whole buffers to a raw
+ * log next to the trace. At exit the log is sorted by sequence
+ * number and written as the .rep trace. Blocks allocated before
+ * the shim was loaded, or with memalign and friends, are not
+ * recorded. Recording stops in a forked child, and threads still
+ * running at exit may lose their last records.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SHARDS      256          /* shards of the address table */
+#define SHARD_MIN   1024         /* initial slots of a shard */
+#define BUFRECS     4096         /* records buffered per thread */
+#define BOOTSTRAP   (64 << 10)   /* bytes served while dlsym runs */
+#define MAXLINE     1024         /* max string size */
+
+/* One recorded request */
+typedef struct {
+    uint64_t seq;                /* global order of the request */
+    uint32_t id;                 /* id of the block */
+    uint32_t size;               /* requested bytes, at most INT_MAX;
+				    unused by free */
+    uint32_t type;               /* 'a', 'c', 'r' or 'f' */
+} rec_t;
+
+/* Slot of the address table */
+typedef struct {
+    void *p;                     /* address of the block, or NULL */
+    uint32_t id;                 /* id of the block */
+} slot_t;
+
+/* Shard of the address table; open addressing with linear probing */
+typedef struct {
+    pthread_mutex_t lock;
+    slot_t *table;
+    size_t mask;                 /* number of slots - 1 */
+    size_t count;                /* number of used slots */
+} shard_t;
+
+/* Records buffered by one thread */
+typedef struct buf_t {
+    rec_t rec[BUFRECS];
+    int n;                       /* number of buffered records */
+    struct buf_t *next;          /* list of all buffers, for exit */
+} buf_t;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+static shard_t shards[SHARDS];
+static uint64_t next_seq;        /* next sequence number */
+static uint32_t next_id;         /* next block id */
+static int log_fd = -1;          /* raw log of records */
+static int done;                 /* set at exit and in forked children */
+static char trace_path[MAXLINE];
+static char log_path[MAXLINE + 8];
+
+static pthread_mutex_t buf_lock = PTHREAD_MUTEX_INITIALIZER;
+static buf_t *buf_list;          /* buffers of all threads */
+static pthread_key_t buf_key;
+
+static __thread buf_t *my_buf;   /* buffer of calling thread */
+static __thread int busy;        /* set while the shim itself runs */
+
+static char bootstrap[BOOTSTRAP] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+
+/*********************
+ * Address table
+ *********************/
+
+static size_t hash(void *p)
+{
+    return ((uintptr_t)p >> 4) * 2654435761u;
+}
+
+static void *map_zero(size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * shard_find - Return the slot of p, or the empty slot it would take
+ */
+static slot_t *shard_find(shard_t *s, void *p)
+{
+    size_t i;
+
+    for (i = (hash(p) >> 8) & s->mask;
+	 s->table[i].p != NULL && s->table[i].p != p;
+	 i = (i + 1) & s->mask)
+	;
+    return &s->table[i];
+}
+
+/*
+ * shard_grow - Double the slots of a shard. Returns -1 if out of memory.
+ */
+static int shard_grow(shard_t *s)
+{
+    slot_t *old = s->table;
+    size_t i, oldmask = s->mask;
+
+    s->mask = old ? oldmask * 2 + 1 : SHARD_MIN - 1;
+    if ((s->table = map_zero((s->mask + 1) * sizeof(slot_t))) == NULL) {
+	s->table = old;
+	s->mask = oldmask;
+	return -1;
+    }
+    for (i = 0;  old && i <= oldmask;  i++)
+	if (old[i].p != NULL)
+	    *shard_find(s, old[i].p) = old[i];
+    if (old)
+	munmap(old, (oldmask + 1) * sizeof(slot_t));
+    return 0;
+}
+
+/*
+ * table_insert - Map address p to id
+ */
+static void table_insert(void *p, uint32_t id)
+{
+    shard_t *s = &shards[hash(p) & (SHARDS - 1)];
+    slot_t *slot;
+
+    pthread_mutex_lock(&s->lock);
+    if ((s->table == NULL || s->count * 2 >= s->mask) && shard_grow(s) < 0) {
+	pthread_mutex_unlock(&s->lock);
+	return;
+    }
+    slot = shard_find(s, p);
+    if (slot->p == NULL)
+	s->count++;
+    slot->p = p;
+    slot->id = id;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * table_remove - Unmap address p. Returns 0 if p isn't mapped. Entries
+ *     after the slot in the same probe run are moved back.
+ */
+static int table_remove(void *p, uint32_t *id)
+{
+    shard_t *s = &shards[hash(p) & (SHARDS - 1)];
+    size_t i, j, home;
+    slot_t *slot;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->table == NULL || (slot = shard_find(s, p))->p == NULL) {
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+    }
+    *id = slot->id;
+    i = slot - s->table;
+    for (j = (i + 1) & s->mask;  s->table[j].p != NULL;  j = (j + 1) & s->mask) {
+	home = (hash(s->table[j].p) >> 8) & s->mask;
+	if (((j - home) & s->mask) >= ((j - i) & s->mask)) {
+	    s->table[i] = s->table[j];
+	    i = j;
+	}
+    }
+    s->table[i].p = NULL;
+    s->count--;
+    pthread_mutex_unlock(&s->lock);
+    return 1;
+}
+
+/*********************
+ * Buffered writer
+ *********************/
+
+/*
+ * buf_flush - Append the records of a buffer to the raw log
+ */
+static void buf_flush(buf_t *b)
+{
+    char *p = (char *)b->rec;
+    size_t len = b->n * sizeof(rec_t);
+    ssize_t n;
+
+    pthread_mutex_lock(&buf_lock);
+    while (log_fd >= 0 && len > 0 && (n = write(log_fd, p, len)) > 0) {
+	p += n;
+	len -= n;
+    }
+    pthread_mutex_unlock(&buf_lock);
+    b->n = 0;
+}
+
+/*
+ * buf_exit - Flush buffer of a thread when it exits
+ */
+static void buf_exit(void *arg)
+{
+    buf_flush((buf_t *)arg);
+}
+
+/*
+ * record - Buffer one request of calling thread
+ */
+static void record(int type, uint64_t seq, uint32_t id, size_t size)
+{
+    buf_t *b = my_buf;
+
+    if (b == NULL) {
+	if ((b = map_zero(sizeof(buf_t))) == NULL)
+	    return;
+	pthread_mutex_lock(&buf_lock);
+	b->next = buf_list;
+	buf_list = b;
+	pthread_mutex_unlock(&buf_lock);
+	pthread_setspecific(buf_key, b);
+	my_buf = b;
+    }
+    b->rec[b->n].seq = seq;
+    b->rec[b->n].id = id;
+    b->rec[b->n].size = size > INT_MAX ? INT_MAX : size;
+    b->rec[b->n].type = type;
+    if (++b->n == BUFRECS)
+	buf_flush(b);
+}
+
+/*********************
+ * Setup and teardown
+ *********************/
+
+/*
+ * bootstrap_alloc - Serve zeroed memory while dlsym resolves the
+ *     real functions. It's never freed.
+ */
+static void *bootstrap_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (size > BOOTSTRAP - bootstrap_used)
+	return NULL;
+    p = bootstrap + bootstrap_used;
+    bootstrap_used += size;
+    return p;
+}
+
+static int is_bootstrap(void *p)
+{
+    return (char *)p >= bootstrap && (char *)p < bootstrap + BOOTSTRAP;
+}
+
+static void fork_child(void)
+{
+    done = 1;
+    log_fd = -1;
+}
+
+static void resolve(void)
+{
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+}
+
+__attribute__((constructor)) static void tracecap_init(void)
+{
+    char *path, *pid;
+    int i;
+
+    busy++;
+    if (real_malloc == NULL)
+	resolve();
+    for (i = 0;  i < SHARDS;  i++)
+	pthread_mutex_init(&shards[i].lock, NULL);
+    pthread_key_create(&buf_key, buf_exit);
+    pthread_atfork(NULL, NULL, fork_child);
+
+    /* %p in the name becomes the pid, so programs run by app get their own */
+    if ((path = getenv("TRACECAP_FILE")) == NULL)
+	path = "tracecap.%p.rep";
+    if ((pid = strstr(path, "%p")) != NULL)
+	snprintf(trace_path, sizeof(trace_path), "%.*s%d%s", 
+		 (int)(pid - path), path, (int)getpid(), pid + 2);
+    else
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+    snprintf(log_path, sizeof(log_path), "%s.raw", trace_path);
+    log_fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    busy--;
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const rec_t *)a)->seq, y = ((const rec_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * write_trace - Sort the raw log and write it as .rep trace
+ */
+static void write_trace(void)
+{
+    int fd;
+    struct stat st;
+    rec_t *rec;
+    size_t i, n;
+    uint32_t num_ids = 0;
+    FILE *out;
+
+    if ((fd = open(log_path, O_RDONLY)) < 0)
+	return;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 ||
+	(rec = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+	close(fd);
+	return;
+    }
+    close(fd);
+    n = st.st_size / sizeof(rec_t);
+    qsort(rec, n, sizeof(rec_t), rec_cmp);
+    for (i = 0;  i < n;  i++)
+	if (rec[i].id + 1 > num_ids)
+	    num_ids = rec[i].id + 1;
+
+    if ((out = fopen(trace_path, "w")) != NULL) {
+	fprintf(out, "%d\n%u\n%lu\n%d\n", 0, num_ids, (unsigned long)n, 1);
+	for (i = 0;  i < n;  i++) {
+	    if (rec[i].type == 'f')
+		fprintf(out, "f %u\n", rec[i].id);
+	    else
+		fprintf(out, "%c %u %u\n", rec[i].type, rec[i].id, rec[i].size);
+	}
+	fclose(out);
+	unlink(log_path);
+    }
+    munmap(rec, st.st_size);
+}
+
+__attribute__((destructor)) static void tracecap_exit(void)
+{
+    buf_t *b;
+
+    if (done)
+	return;
+    busy++;
+    done = 1;
+    for (b = buf_list;  b != NULL;  b = b->next)
+	buf_flush(b);
+    close(log_fd);
+    log_fd = -1;
+    write_trace();
+    busy--;
+}
+
+/*********************
+ * Interposed functions
+ *********************/
+
+/*
+ * recording - Returns 1 if calling thread should record its request
+ */
+static int recording(void)
+{
+    if (real_malloc == NULL)
+	resolve();
+    return !busy && !done;
+}
+
+void *malloc(size_t size)
+{
+    void *p;
+    uint32_t id;
+
+    if (real_malloc == NULL)
+	return bootstrap_alloc(size);
+    if ((p = real_malloc(size)) != NULL && recording()) {
+	busy++;
+	id = __sync_fetch_and_add(&next_id, 1);
+	record('a', __sync_fetch_and_add(&next_seq, 1), id, size);
+	table_insert(p, id);
+	busy--;
+    }
+    return p;
+}
+
+void *calloc(size_t n, size_t size)
+{
+    void *p;
+    uint32_t id;
+
+    if (real_calloc == NULL)
+	return (size == 0 || n <= SIZE_MAX / size) ? bootstrap_alloc(n * size) : NULL;
+    if ((p = real_calloc(n, size)) != NULL && recording()) {
+	busy++;
+	id = __sync_fetch_and_add(&next_id, 1);
+	record('c', __sync_fetch_and_add(&next_seq, 1), id, n * size);
+	table_insert(p, id);
+	busy--;
+    }
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    void *p;
+    uint32_t id;
+    int known;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (is_bootstrap(ptr)) {
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, size < (size_t)(bootstrap + BOOTSTRAP - (char *)ptr) ?
+		   size : (size_t)(bootstrap + BOOTSTRAP - (char *)ptr));
+	return p;
+    }
+    if (!recording())
+	return real_realloc(ptr, size);
+
+    busy++;
+    known = table_remove(ptr, &id);
+    if (size == 0) {
+	if (known)
+	    record('f', __sync_fetch_and_add(&next_seq, 1), id, 0);
+	busy--;
+	return real_realloc(ptr, size);
+    }
+    busy--;
+
+    p = real_realloc(ptr, size);
+
+    busy++;
+    if (p == NULL) {
+	if (known)
+	    table_insert(ptr, id);  /* old block stays */
+    }
+    else {
+	if (!known)
+	    id = __sync_fetch_and_add(&next_id, 1);
+	record(known ? 'r' : 'a', __sync_fetch_and_add(&next_seq, 1), id, size);
+	table_insert(p, id);
+    }
+    busy--;
+    return p;
+}
+
+void free(void *ptr)
+{
+    uint32_t id;
+
+    if (ptr == NULL || is_bootstrap(ptr))
+	return;
+    if (recording()) {
+	busy++;
+	if (table_remove(ptr, &id))
+	    record('f', __sync_fetch_and_add(&next_seq, 1), id, 0);
+	busy--;
+    }
+    real_free(ptr);
+}